@@ -0,0 +1,248 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * channels.c - UHF channel table and per-channel MAX2163 register images
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "channels.h"
+#include "dividers.h"
+
+/* Upper edge of each RF filter band, in MHz */
+static const struct {
+	int limit;
+	unsigned char range;
+} ib200_bands[] = {
+	{ 488, UHF_RANGE_470_488MHZ },
+	{ 512, UHF_RANGE_488_512MHZ },
+	{ 542, UHF_RANGE_512_542MHZ },
+	{ 572, UHF_RANGE_542_572MHZ },
+	{ 608, UHF_RANGE_572_608MHZ },
+	{ 656, UHF_RANGE_608_656MHZ },
+	{ 710, UHF_RANGE_656_710MHZ },
+};
+
+static int
+ib200_dividers_compare(const void *key, const void *entry)
+{
+	uint32_t frequency = *(const uint32_t *) key;
+	const struct ib200_dividers *dividers = (const struct ib200_dividers *) entry;
+
+	return frequency < dividers->frequency ? -1 : frequency > dividers->frequency;
+}
+
+/**
+ * Pick the PLL dividers of a frequency: the R/N pair whose LO frequency comes
+ * closest to frequency + IB200_IF_FREQ, preferring the smallest R (highest
+ * comparison frequency, hence fastest lock) among equally accurate pairs.
+ * The channels of channel_frequencies.conf are solved beforehand by
+ * divider-solver.py; other frequencies are searched here.
+ */
+static void
+ib200_solve_dividers(struct ib200_channel *channel, uint32_t frequency)
+{
+	const struct ib200_dividers *dividers;
+	uint64_t lo = (uint64_t) frequency + IB200_IF_FREQ;
+	uint64_t crystal = VCO_CRYSTAL_FREQ * 1000000ULL;
+	int r, n;
+
+	dividers = bsearch(&frequency, ib200_dividers, sizeof(ib200_dividers)/sizeof(ib200_dividers[0]),
+		sizeof(ib200_dividers[0]), ib200_dividers_compare);
+	if (dividers) {
+		channel->r_divider = dividers->r_divider;
+		channel->n_divider = dividers->n_divider;
+		channel->error = dividers->error;
+		return;
+	}
+
+	channel->error = UINT32_MAX;
+	for (r=RDIVIDER_MIN; r<=RDIVIDER_MAX; ++r) {
+		uint64_t lo_n, error;
+
+		n = (lo * r + crystal / 2) / crystal;
+		if (n < NDIVIDER_MIN || n > NDIVIDER_MAX)
+			continue;
+		/* Compare errors to the Hz, as divider-solver.py does */
+		lo_n = (n * crystal + r / 2) / r;
+		error = lo_n > lo ? lo_n - lo : lo - lo_n;
+		if (error < channel->error) {
+			channel->r_divider = r;
+			channel->n_divider = n;
+			channel->error = error;
+		}
+	}
+}
+
+static void
+ib200_channel_set(struct ib200_channel *channel, unsigned char reg, unsigned char mask, unsigned char value)
+{
+	channel->val[reg] = (channel->val[reg] & ~mask) | (value & mask);
+	channel->mask[reg] |= mask;
+	channel->regs |= 1 << reg;
+}
+
+/* Work out the register image of a channel from its frequency */
+static void
+ib200_channel_compute(struct ib200_channel *channel, int number, uint32_t frequency)
+{
+	int i, mhz = frequency / 1000000;
+	unsigned char range = UHF_RANGE_710_806MHZ;
+
+	memset(channel, 0, sizeof(*channel));
+	channel->number = number;
+	channel->frequency = frequency;
+
+	for (i=0; i<sizeof(ib200_bands)/sizeof(ib200_bands[0]); ++i)
+		if (mhz < ib200_bands[i].limit) {
+			range = ib200_bands[i].range;
+			break;
+		}
+
+	ib200_solve_dividers(channel, frequency);
+
+	ib200_channel_set(channel, RF_FILTER_REG, UHF_RANGE_MASK, range);
+	ib200_channel_set(channel, RDIVIDER_MSB_REG, RDIVIDER_MSB_REG_MASK, PLL_MOST_RDIVIDER(channel->r_divider));
+	ib200_channel_set(channel, RDIVIDER_LSB_REG, RDIVIDER_LSB_MASK, PLL_LEAST_RDIVIDER(channel->r_divider));
+	ib200_channel_set(channel, NDIVIDER_MSB_REG, 0xff, PLL_MOST_NDIVIDER(channel->n_divider));
+	ib200_channel_set(channel, NDIVIDER_LSB_REG, NDIVIDER_LSB_MASK, PLL_LEAST_NDIVIDER(channel->n_divider));
+}
+
+static void
+ib200_channels_clear(struct ib200_channels *channels)
+{
+	int i;
+
+	memset(channels, 0, sizeof(*channels));
+	for (i=0; i<IB200_CHANNEL_COUNT; ++i)
+		channels->channel[i].number = IB200_CHANNEL_MIN + i;
+}
+
+/**
+ * Fill the table with every UHF channel, at the centres listed in
+ * channel_frequencies.conf (1/7 MHz above the middle of each 6MHz slot).
+ */
+void
+ib200_channels_default(struct ib200_channels *channels)
+{
+	int i;
+
+	ib200_channels_clear(channels);
+	for (i=0; i<IB200_CHANNEL_COUNT; ++i)
+		ib200_channel_compute(&channels->channel[i], IB200_CHANNEL_MIN + i,
+			IB200_CHANNEL_BASE + i * IB200_CHANNEL_WIDTH + 3142857);
+	channels->count = IB200_CHANNEL_COUNT;
+}
+
+/**
+ * Load a channel list in the format of channel_frequencies.conf: one
+ * "T <frequency in Hz> ..." line per channel in use. The channel number is
+ * worked out from the frequency.
+ * @param path file to load
+ * @param channels output
+ * @return the number of channels in use on success or a negative value on error.
+ */
+int
+ib200_channels_load(const char *path, struct ib200_channels *channels)
+{
+	char line[256];
+	unsigned long frequency;
+	int number, lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (! fp) {
+		perror(path);
+		return -errno;
+	}
+
+	ib200_channels_clear(channels);
+	while (fgets(line, sizeof(line), fp)) {
+		char type;
+
+		lineno++;
+		if (sscanf(line, " %c", &type) != 1 || type == '#')
+			continue;
+		if (type != 'T' || sscanf(line, " T %lu", &frequency) != 1) {
+			fprintf(stderr, "%s:%d: not a terrestrial channel entry\n", path, lineno);
+			continue;
+		}
+
+		number = frequency < IB200_CHANNEL_BASE ? -1 :
+			(frequency - IB200_CHANNEL_BASE) / IB200_CHANNEL_WIDTH + IB200_CHANNEL_MIN;
+		if (number < IB200_CHANNEL_MIN || number > IB200_CHANNEL_MAX) {
+			fprintf(stderr, "%s:%d: %lu Hz is not an UHF channel\n", path, lineno, frequency);
+			continue;
+		}
+
+		if (! channels->channel[number - IB200_CHANNEL_MIN].frequency)
+			channels->count++;
+		ib200_channel_compute(&channels->channel[number - IB200_CHANNEL_MIN], number, frequency);
+	}
+
+	fclose(fp);
+	return channels->count;
+}
+
+/**
+ * Look a channel up.
+ * @return the channel, or NULL if it is not in use.
+ */
+const struct ib200_channel *
+ib200_channel_get(const struct ib200_channels *channels, int number)
+{
+	const struct ib200_channel *channel;
+
+	if (number < IB200_CHANNEL_MIN || number > IB200_CHANNEL_MAX)
+		return NULL;
+	channel = &channels->channel[number - IB200_CHANNEL_MIN];
+	return channel->frequency ? channel : NULL;
+}
+
+/**
+ * Map the whole MHz part of a channel centre (473, 479, ...) to its number.
+ * @return the channel number, or -EINVAL if mhz is not the centre of a channel.
+ */
+int
+ib200_channel_of_mhz(int mhz)
+{
+	int width = IB200_CHANNEL_WIDTH / 1000000;
+	int offset = mhz - IB200_CHANNEL_BASE / 1000000 - width / 2;
+
+	if (offset < 0 || offset % width || offset / width >= IB200_CHANNEL_COUNT)
+		return -EINVAL;
+	return IB200_CHANNEL_MIN + offset / width;
+}
+
+/**
+ * RF filter band of a channel.
+ * @return its UHF_RANGE_* value.
+ */
+int
+ib200_channel_band(const struct ib200_channel *channel)
+{
+	return channel->val[RF_FILTER_REG] & UHF_RANGE_MASK;
+}
@@ -0,0 +1,79 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * channels.h - UHF channel table and per-channel MAX2163 register images
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#ifndef __channels_h
+#define __channels_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "max2163.h"
+
+#define IB200_CHANNELS_FILE    "channel_frequencies.conf"
+
+/* UHF channels 14 to 69 (ABNT NBR 15608-1), 6MHz apart */
+#define IB200_CHANNEL_MIN      14
+#define IB200_CHANNEL_MAX      69
+#define IB200_CHANNEL_COUNT    (IB200_CHANNEL_MAX - IB200_CHANNEL_MIN + 1)
+#define IB200_CHANNEL_BASE     470000000  /* lower edge of channel 14, in Hz */
+#define IB200_CHANNEL_WIDTH    6000000    /* in Hz */
+
+/* RF filter bands of the MAX2163, UHF_RANGE_470_488MHZ to UHF_RANGE_710_806MHZ */
+#define IB200_BAND_COUNT       8
+
+#define DEFAULT_RDIVIDER 0x70     /* default PLL reference divider */
+#define VCO_CRYSTAL_FREQ 32 /* The oscillator crystal used for driving
+                               the PLL reference frequency operates at 32MHz */
+
+/* Low IF of the 1-segment receiver (4/7 MHz): the LO runs this much above the channel centre */
+#define IB200_IF_FREQ    571429   /* in Hz */
+
+/**
+ * MAX2163 register image that tunes to a channel. Only the fields flagged in
+ * mask[] belong to the image; the other bits of each register are left alone.
+ */
+struct ib200_channel {
+	int number;
+	uint32_t frequency;                     /* centre frequency in Hz, 0 if not in use */
+	int r_divider;
+	int n_divider;
+	uint32_t error;                         /* LO frequency error of the dividers, in Hz */
+	uint32_t regs;                          /* registers touched by the image */
+	unsigned char mask[MAX2163_NUM_REGS];
+	unsigned char val[MAX2163_NUM_REGS];
+};
+
+/* Channels indexed by number - IB200_CHANNEL_MIN */
+struct ib200_channels {
+	struct ib200_channel channel[IB200_CHANNEL_COUNT];
+	int count;                              /* channels in use */
+};
+
+int ib200_channels_load(const char *path, struct ib200_channels *channels);
+void ib200_channels_default(struct ib200_channels *channels);
+const struct ib200_channel *ib200_channel_get(const struct ib200_channels *channels, int number);
+int ib200_channel_of_mhz(int mhz);
+int ib200_channel_band(const struct ib200_channel *channel);
+
+#endif /* __channels_h */
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+#
+# Settle time extractor for the UsbSnoop captures in logs/Log.
+#
+# For every vendor request seen in the captures, measures how long the
+# Windows driver waited between its completion and the next vendor request,
+# and emits delays.h: a table of settle times keyed by the 4-byte address
+# prefix of the command (and by the direction of the transfer).
+#
+# The settle time of an address space is the shortest gap ever observed after
+# one of its commands. The captures only have millisecond resolution, so a
+# value of 0 means that the next request went down within the same tick.
+#
+# Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+#  any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+import os
+from usbsnoop import UsbSnoopLog
+
+CMD_SIZE = 13
+
+header = """/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * delays.h - settle times required after each vendor request
+ *
+ * Generated by delay-extractor.py from:
+%s *
+ * Do not edit this file by hand.
+ */
+#ifndef __delays_h
+#define __delays_h
+
+struct ib200_delay {
+	unsigned char prefix[4];  /* address space, i.e. the first 4 bytes of the command */
+	bool in;                  /* IN response rather than OUT command */
+	unsigned int delay;       /* in usecs */
+};
+
+static const struct ib200_delay ib200_delays[] = {
+"""
+
+footer = """};
+
+#endif /* __delays_h */
+"""
+
+class DelayExtractor :
+	def __init__(self, filenames) :
+		self.filenames = filenames
+		self.gaps = {}
+
+	def extractDelays(self) :
+		for filename in self.filenames :
+			urbs = [urb for urb in UsbSnoopLog(filename).urbs() if urb.isVendor()]
+			for this, following in zip(urbs, urbs[1:]) :
+				if this.t_up is None or len(this.data()) != CMD_SIZE :
+					continue
+				key = (this.prefix(), this.direction_in)
+				self.gaps.setdefault(key, []).append(following.t_down - this.t_up)
+
+	def writeHeader(self, outfile) :
+		fp = open(outfile, "w")
+		fp.write(header % "".join(" *   %s\n" % f for f in self.filenames))
+		for (prefix, direction_in), gaps in sorted(self.gaps.items()) :
+			gaps.sort()
+			fp.write("\t{ { %s }, %-6s %5d },  /* %3d samples, median %d ms, max %d ms */\n" % (
+				", ".join("0x%02x" % x for x in prefix),
+				"true," if direction_in else "false,",
+				gaps[0] * 1000, len(gaps), gaps[len(gaps) // 2], gaps[-1]))
+		fp.write(footer)
+		fp.close()
+
+
+if len(os.sys.argv) < 3 :
+	print("Syntax: %s <delays.h> <capture.log.bz2> [capture.log.bz2...]" % os.sys.argv[0])
+	os.sys.exit(1)
+
+de = DelayExtractor(os.sys.argv[2:])
+de.extractDelays()
+de.writeHeader(os.sys.argv[1])
@@ -0,0 +1,38 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * delays.h - settle times required after each vendor request
+ *
+ * Generated by delay-extractor.py from:
+ *   logs/Log/lucasvr-01-hotplug.log.bz2
+ *   logs/Log/lucasvr-02-tune_to_record.log.bz2
+ *   logs/Log/lucasvr-03-tune_to_record.log.bz2
+ *   logs/Log/lucasvr-04-tune_to_record.log.bz2
+ *   logs/Log/lucasvr-05-tune_from_globo_to_record.log.bz2
+ *   logs/Log/lucasvr-06-tune_to_globo.log.bz2
+ *   logs/Log/lucasvr-07-tune_to_globo.log.bz2
+ *   logs/Log/lucasvr-08-tune_to_globo.log.bz2
+ *
+ * Do not edit this file by hand.
+ */
+#ifndef __delays_h
+#define __delays_h
+
+struct ib200_delay {
+	unsigned char prefix[4];  /* address space, i.e. the first 4 bytes of the command */
+	bool in;                  /* IN response rather than OUT command */
+	unsigned int delay;       /* in usecs */
+};
+
+static const struct ib200_delay ib200_delays[] = {
+	{ { 0x0b, 0x00, 0x00, 0x82 }, false,     0 },  /* 111 samples, median 100 ms, max 3001 ms */
+	{ { 0x0b, 0x00, 0x20, 0x82 }, false,     0 },  /*  33 samples, median 0 ms, max 1 ms */
+	{ { 0x0b, 0x00, 0x20, 0x82 }, true,      0 },  /*  33 samples, median 0 ms, max 1 ms */
+	{ { 0x0b, 0xc0, 0xc0, 0x01 }, false,     0 },  /*  57 samples, median 0 ms, max 1 ms */
+	{ { 0x0b, 0xee, 0xc0, 0x01 }, false,     0 },  /*  49 samples, median 0 ms, max 18 ms */
+	{ { 0x0b, 0xee, 0xc4, 0x01 }, false, 19000 },  /*  57 samples, median 20 ms, max 21 ms */
+	{ { 0x0b, 0xee, 0xe0, 0x01 }, false,     0 },  /*  80 samples, median 0 ms, max 1 ms */
+	{ { 0x0b, 0xee, 0xe0, 0x01 }, true,      0 },  /*  80 samples, median 0 ms, max 1 ms */
+};
+
+#endif /* __delays_h */
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+
+#
+# PLL divider solver for the MAX2163.
+#
+# For every channel listed in channel_frequencies.conf, searches the legal
+# reference divider (R) and integer divider (N) ranges for the pair whose
+# local oscillator frequency, N * 32MHz / R, comes closest to the channel
+# centre plus the 4/7 MHz low IF (high-side injection). Among pairs that are
+# equally accurate to the Hz, the one with the smallest R wins: its higher
+# comparison frequency makes the PLL lock faster.
+#
+# Emits dividers.h, the table looked up by channels.c.
+#
+# Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+#  any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+import os
+
+# Keep in sync with channels.h and max2163.h
+CRYSTAL_FREQ = 32000000
+IF_FREQ = 571429
+RDIVIDER_MIN, RDIVIDER_MAX = 16, 511
+NDIVIDER_MIN, NDIVIDER_MAX = 1314, 2687
+
+header = """/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * dividers.h - MAX2163 PLL dividers of each channel
+ *
+ * Generated by divider-solver.py from %s
+ *
+ * Do not edit this file by hand.
+ */
+#ifndef __dividers_h
+#define __dividers_h
+
+struct ib200_dividers {
+	uint32_t frequency;       /* channel centre, in Hz */
+	int r_divider;
+	int n_divider;
+	uint32_t error;           /* distance from the wanted LO frequency, in Hz */
+};
+
+/* Sorted by frequency */
+static const struct ib200_dividers ib200_dividers[] = {
+"""
+
+footer = """};
+
+#endif /* __dividers_h */
+"""
+
+class DividerSolver :
+	def __init__(self, filename) :
+		self.filename = filename
+		self.frequencies = []
+
+	def readChannels(self) :
+		for line in open(self.filename) :
+			fields = line.split()
+			if len(fields) >= 2 and fields[0] == "T" :
+				self.frequencies.append(int(fields[1]))
+		self.frequencies.sort()
+
+	def solve(self, frequency) :
+		lo = frequency + IF_FREQ
+		best = None
+		for r in range(RDIVIDER_MIN, RDIVIDER_MAX + 1) :
+			n = round(lo * r / CRYSTAL_FREQ)
+			if n < NDIVIDER_MIN or n > NDIVIDER_MAX :
+				continue
+			error = abs(n * CRYSTAL_FREQ / r - lo)
+			if best is None or round(error) < round(best[2]) :
+				best = (r, n, error)
+		return best
+
+	def writeHeader(self, outfile) :
+		fp = open(outfile, "w")
+		fp.write(header % self.filename)
+		for frequency in self.frequencies :
+			r, n, error = self.solve(frequency)
+			fp.write("\t{ %9d, %3d, %4d, %4d },  /* comparison frequency %d Hz */\n" % (
+				frequency, r, n, round(error), CRYSTAL_FREQ // r))
+		fp.write(footer)
+		fp.close()
+
+
+if len(os.sys.argv) != 3 :
+	print("Syntax: %s <dividers.h> <channel_frequencies.conf>" % os.sys.argv[0])
+	os.sys.exit(1)
+
+ds = DividerSolver(os.sys.argv[2])
+ds.readChannels()
+ds.writeHeader(os.sys.argv[1])
@@ -0,0 +1,79 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * dividers.h - MAX2163 PLL dividers of each channel
+ *
+ * Generated by divider-solver.py from channel_frequencies.conf
+ *
+ * Do not edit this file by hand.
+ */
+#ifndef __dividers_h
+#define __dividers_h
+
+struct ib200_dividers {
+	uint32_t frequency;       /* channel centre, in Hz */
+	int r_divider;
+	int n_divider;
+	uint32_t error;           /* distance from the wanted LO frequency, in Hz */
+};
+
+/* Sorted by frequency */
+static const struct ib200_dividers ib200_dividers[] = {
+	{ 473142857, 112, 1658,    0 },  /* comparison frequency 285714 Hz */
+	{ 479142857, 112, 1679,    0 },  /* comparison frequency 285714 Hz */
+	{ 485142857, 112, 1700,    0 },  /* comparison frequency 285714 Hz */
+	{ 491142857, 112, 1721,    0 },  /* comparison frequency 285714 Hz */
+	{ 497142857, 112, 1742,    0 },  /* comparison frequency 285714 Hz */
+	{ 503142857, 112, 1763,    0 },  /* comparison frequency 285714 Hz */
+	{ 509142857,  84, 1338,    0 },  /* comparison frequency 380952 Hz */
+	{ 515142857, 112, 1805,    0 },  /* comparison frequency 285714 Hz */
+	{ 521142857, 112, 1826,    0 },  /* comparison frequency 285714 Hz */
+	{ 527142857, 112, 1847,    0 },  /* comparison frequency 285714 Hz */
+	{ 533142857,  84, 1401,    0 },  /* comparison frequency 380952 Hz */
+	{ 539142857, 112, 1889,    0 },  /* comparison frequency 285714 Hz */
+	{ 545142857, 112, 1910,    0 },  /* comparison frequency 285714 Hz */
+	{ 551142857, 112, 1931,    0 },  /* comparison frequency 285714 Hz */
+	{ 557142857,  77, 1342,    0 },  /* comparison frequency 415584 Hz */
+	{ 563142857, 112, 1973,    0 },  /* comparison frequency 285714 Hz */
+	{ 569142857, 112, 1994,    0 },  /* comparison frequency 285714 Hz */
+	{ 575142857, 112, 2015,    0 },  /* comparison frequency 285714 Hz */
+	{ 581142857,  84, 1527,    0 },  /* comparison frequency 380952 Hz */
+	{ 587142857, 112, 2057,    0 },  /* comparison frequency 285714 Hz */
+	{ 593142857, 112, 2078,    0 },  /* comparison frequency 285714 Hz */
+	{ 599142857, 112, 2099,    0 },  /* comparison frequency 285714 Hz */
+	{ 605142857,  70, 1325,    0 },  /* comparison frequency 457142 Hz */
+	{ 617142857, 112, 2162,    0 },  /* comparison frequency 285714 Hz */
+	{ 623142857, 112, 2183,    0 },  /* comparison frequency 285714 Hz */
+	{ 629142857,  84, 1653,    0 },  /* comparison frequency 380952 Hz */
+	{ 635142857, 112, 2225,    0 },  /* comparison frequency 285714 Hz */
+	{ 641142857, 112, 2246,    0 },  /* comparison frequency 285714 Hz */
+	{ 647142857, 112, 2267,    0 },  /* comparison frequency 285714 Hz */
+	{ 653142857,  70, 1430,    0 },  /* comparison frequency 457142 Hz */
+	{ 659142857, 112, 2309,    0 },  /* comparison frequency 285714 Hz */
+	{ 665142857, 112, 2330,    0 },  /* comparison frequency 285714 Hz */
+	{ 671142857, 112, 2351,    0 },  /* comparison frequency 285714 Hz */
+	{ 677142857,  84, 1779,    0 },  /* comparison frequency 380952 Hz */
+	{ 683142857, 112, 2393,    0 },  /* comparison frequency 285714 Hz */
+	{ 689142857, 112, 2414,    0 },  /* comparison frequency 285714 Hz */
+	{ 695142857, 112, 2435,    0 },  /* comparison frequency 285714 Hz */
+	{ 701142857,  70, 1535,    0 },  /* comparison frequency 457142 Hz */
+	{ 707142857, 112, 2477,    0 },  /* comparison frequency 285714 Hz */
+	{ 713142857, 112, 2498,    0 },  /* comparison frequency 285714 Hz */
+	{ 719142857, 112, 2519,    0 },  /* comparison frequency 285714 Hz */
+	{ 725142857,  84, 1905,    0 },  /* comparison frequency 380952 Hz */
+	{ 731142857, 112, 2561,    0 },  /* comparison frequency 285714 Hz */
+	{ 737142857, 112, 2582,    0 },  /* comparison frequency 285714 Hz */
+	{ 743142857, 112, 2603,    0 },  /* comparison frequency 285714 Hz */
+	{ 749142857,  63, 1476,    0 },  /* comparison frequency 507936 Hz */
+	{ 755142857, 112, 2645,    0 },  /* comparison frequency 285714 Hz */
+	{ 761142857,  56, 1333,    0 },  /* comparison frequency 571428 Hz */
+	{ 767142857, 112, 2687,    0 },  /* comparison frequency 285714 Hz */
+	{ 773142857,  56, 1354,    0 },  /* comparison frequency 571428 Hz */
+	{ 779142857,  71, 1730, 4024 },  /* comparison frequency 450704 Hz */
+	{ 785142857,  56, 1375,    0 },  /* comparison frequency 571428 Hz */
+	{ 791142857,  85, 2103, 3361 },  /* comparison frequency 376470 Hz */
+	{ 797142857,  56, 1396,    0 },  /* comparison frequency 571428 Hz */
+	{ 803142857,  69, 1733, 4141 },  /* comparison frequency 463768 Hz */
+};
+
+#endif /* __dividers_h */
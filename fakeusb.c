@@ -0,0 +1,692 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * fakeusb.c - software stand-in for the device, linked in place of libusb
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <libusb.h>
+
+/**
+ * Implements the part of the libusb API used by zinwell.c on top of an
+ * emulated 5a57:4210 device, so that the driver can be run and timed without
+ * hardware ('make bench-startup'). The emulation covers what the driver
+ * relies on:
+ *  - SMI-2020CBE registers: writes (0b 00 00 82 01 <bank> <reg> <val>) are
+ *    stored and reads (0b 00 20 82 01 15 <reg>) return them in byte 7;
+ *  - MAX2163 registers: I2C writes are stored, and I2C reads return the
+ *    selected register in byte 6. STATUS_REG reports a power cycle until read;
+ *  - the PLL takes a while to lock after each new setting: the VCO autoselect
+ *    walks from its start point to the VCO/sub-band of the LO frequency, one
+ *    VAS wait time per step, then the loop settles faster the higher the
+ *    charge pump current. Meanwhile STATUS_REG reads the tuning voltage at
+ *    the rail and VAS_STATUS_REG flags the search as active. CPS_AUTOMATIC
+ *    picks 2mA. The lock does not hold, the tuning voltage hitting the rail
+ *    every few msecs, with more charge pump current than the UHF band of
+ *    RF_FILTER_REG takes, or with a VAS wait time too short for a reference
+ *    divider of FAKEUSB_SLOW_RDIVIDER or more;
+ *  - 0b ee e0 01 register 0x32 steps 06, 07, 08, 0a over FAKEUSB_SYNC_TIME
+ *    once the PLL locked, as in logs/Log/lucasvr-02-tune_to_record.log, as if
+ *    every channel carried a broadcast;
+ *  - IN requests otherwise echo the last OUT command;
+ *  - isochronous transfers on EP 0x82 return null transport stream packets
+ *    once alternate setting 1 is selected.
+ *
+ * Where the captures are silent, the emulation follows the driver's own
+ * assumptions, which it therefore cannot catch: the register count in byte 4
+ * of I2C burst writes, the echo of OUT commands on IN requests, and SMI
+ * registers holding whatever was written.
+ *
+ * Every control transfer completes FAKEUSB_LATENCY usecs after the previous
+ * one, and every isochronous packet takes a 125 usecs microframe.
+ *
+ * Environment:
+ *  IB200_FAKEUSB_DEVICES   number of devices to emulate (default 1)
+ *  IB200_FAKEUSB_LATENCY   control transfer latency in usecs (default 250)
+ *  IB200_FAKEUSB_STATE     file keeping the device state across runs, so that
+ *                          a second run finds the devices already initialized
+ */
+
+#define FAKEUSB_VENDOR_ID     0x5a57
+#define FAKEUSB_PRODUCT_ID    0x4210
+#define FAKEUSB_MAX_DEVICES   16
+#define FAKEUSB_LATENCY       250     /* in usecs */
+#define FAKEUSB_MICROFRAME    125     /* in usecs */
+#define FAKEUSB_MAX_PACKET    1023
+#define FAKEUSB_CMD_SIZE      13
+#define FAKEUSB_VCO_BANDS     48      /* 3 VCOs of 16 sub-bands each */
+#define FAKEUSB_SETTLE        600     /* PLL settle time at 1.5mA, in usecs */
+#define FAKEUSB_SLOW_RDIVIDER 96      /* needs AUTOSELECT_24576_WAIT_TIME at least */
+#define FAKEUSB_SYNC_TIME     400000  /* from PLL lock to register 0x32 reading 0x0a, in usecs */
+
+/* What survives between runs, as long as the device stays plugged in */
+struct fakeusb_state {
+	int configuration;
+	unsigned char smi[2][256];      /* banks 0x00 and 0x15 */
+	unsigned char max2163[0x17];
+	bool pwr_cycle;                 /* MAX2163 status not read since power-up */
+	uint64_t tuned_at;              /* last change of the PLL setting, in usecs */
+	unsigned int search_time;       /* VCO autoselect time of that setting, in usecs */
+	unsigned int lock_time;         /* from tuned_at to lock, in usecs; UINT_MAX if never */
+	int vco_start;                  /* VCO/sub-band the autoselect started from */
+	int vco_used;                   /* VCO/sub-band picked by the last search */
+	int charge_pump;                /* CHARGE_PUMP_* >> 6 in use */
+	bool unstable;                  /* the lock of that setting does not hold */
+	int firmware_chunks;
+};
+
+struct libusb_device {
+	struct libusb_context *ctx;
+	uint8_t address;
+	int refcount;
+	struct fakeusb_state state;
+	pthread_mutex_t mutex;          /* protects the fields below and state */
+	bool claimed;
+	int alt_setting;
+	unsigned char last_cmd[FAKEUSB_CMD_SIZE];
+	uint64_t pipe_free;             /* when EP0 finishes its last request, in usecs */
+	uint64_t iso_free;              /* when EP 0x82 finishes its last transfer, in usecs */
+};
+
+struct libusb_device_handle {
+	struct libusb_device *dev;
+};
+
+/* A transfer waiting for its completion time */
+struct fakeusb_pending {
+	struct libusb_transfer *transfer;
+	uint64_t due;                   /* in usecs */
+	struct fakeusb_pending *next;
+};
+
+struct libusb_context {
+	pthread_mutex_t mutex;          /* protects pending */
+	pthread_cond_t cond;
+	struct fakeusb_pending *pending;
+	int num_devices;
+	unsigned int latency;
+	struct libusb_device devices[FAKEUSB_MAX_DEVICES];
+};
+
+static uint64_t
+fakeusb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+fakeusb_load_state(struct libusb_context *ctx)
+{
+	const char *path = getenv("IB200_FAKEUSB_STATE");
+	FILE *fp;
+	int i;
+
+	for (i=0; i<ctx->num_devices; ++i) {
+		memset(&ctx->devices[i].state, 0, sizeof(struct fakeusb_state));
+		ctx->devices[i].state.pwr_cycle = true;
+	}
+	if (! path || ! (fp = fopen(path, "r")))
+		return;
+	for (i=0; i<ctx->num_devices; ++i)
+		if (fread(&ctx->devices[i].state, sizeof(struct fakeusb_state), 1, fp) != 1)
+			break;
+	fclose(fp);
+}
+
+static void
+fakeusb_save_state(struct libusb_context *ctx)
+{
+	const char *path = getenv("IB200_FAKEUSB_STATE");
+	FILE *fp;
+	int i;
+
+	if (! path)
+		return;
+	fp = fopen(path, "w");
+	if (! fp) {
+		perror(path);
+		return;
+	}
+	for (i=0; i<ctx->num_devices; ++i)
+		fwrite(&ctx->devices[i].state, sizeof(struct fakeusb_state), 1, fp);
+	fclose(fp);
+}
+
+int
+libusb_init(libusb_context **ctxp)
+{
+	struct libusb_context *ctx;
+	pthread_condattr_t attr;
+	const char *env;
+	int i;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (! ctx)
+		return LIBUSB_ERROR_NO_MEM;
+	pthread_mutex_init(&ctx->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	env = getenv("IB200_FAKEUSB_DEVICES");
+	ctx->num_devices = env ? atoi(env) : 1;
+	if (ctx->num_devices < 0)
+		ctx->num_devices = 0;
+	else if (ctx->num_devices > FAKEUSB_MAX_DEVICES)
+		ctx->num_devices = FAKEUSB_MAX_DEVICES;
+	env = getenv("IB200_FAKEUSB_LATENCY");
+	ctx->latency = env ? atoi(env) : FAKEUSB_LATENCY;
+
+	for (i=0; i<ctx->num_devices; ++i) {
+		ctx->devices[i].ctx = ctx;
+		ctx->devices[i].address = i + 2;
+		ctx->devices[i].refcount = 1;
+		pthread_mutex_init(&ctx->devices[i].mutex, NULL);
+	}
+	fakeusb_load_state(ctx);
+
+	*ctxp = ctx;
+	return 0;
+}
+
+void
+libusb_exit(libusb_context *ctx)
+{
+	int i;
+
+	fakeusb_save_state(ctx);
+	for (i=0; i<ctx->num_devices; ++i)
+		pthread_mutex_destroy(&ctx->devices[i].mutex);
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx);
+}
+
+void
+libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+
+const char *
+libusb_error_name(int error)
+{
+	switch (error) {
+		case LIBUSB_SUCCESS:
+			return "LIBUSB_SUCCESS";
+		case LIBUSB_ERROR_IO:
+			return "LIBUSB_ERROR_IO";
+		case LIBUSB_ERROR_NOT_FOUND:
+			return "LIBUSB_ERROR_NOT_FOUND";
+		case LIBUSB_ERROR_NO_DEVICE:
+			return "LIBUSB_ERROR_NO_DEVICE";
+		case LIBUSB_ERROR_BUSY:
+			return "LIBUSB_ERROR_BUSY";
+		case LIBUSB_ERROR_PIPE:
+			return "LIBUSB_ERROR_PIPE";
+		case LIBUSB_ERROR_NO_MEM:
+			return "LIBUSB_ERROR_NO_MEM";
+		case LIBUSB_ERROR_NOT_SUPPORTED:
+			return "LIBUSB_ERROR_NOT_SUPPORTED";
+		default:
+			return "LIBUSB_ERROR_OTHER";
+	}
+}
+
+ssize_t
+libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	int i;
+
+	*list = calloc(ctx->num_devices + 1, sizeof(libusb_device *));
+	if (! *list)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i=0; i<ctx->num_devices; ++i)
+		(*list)[i] = &ctx->devices[i];
+	return ctx->num_devices;
+}
+
+void
+libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	free(list);
+}
+
+libusb_device *
+libusb_ref_device(libusb_device *dev)
+{
+	dev->refcount++;
+	return dev;
+}
+
+void
+libusb_unref_device(libusb_device *dev)
+{
+	dev->refcount--;
+}
+
+int
+libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->idVendor = FAKEUSB_VENDOR_ID;
+	desc->idProduct = FAKEUSB_PRODUCT_ID;
+	return 0;
+}
+
+uint8_t
+libusb_get_bus_number(libusb_device *dev)
+{
+	return 1;
+}
+
+uint8_t
+libusb_get_device_address(libusb_device *dev)
+{
+	return dev->address;
+}
+
+int
+libusb_get_max_iso_packet_size(libusb_device *dev, unsigned char endpoint)
+{
+	return FAKEUSB_MAX_PACKET;
+}
+
+int
+libusb_open(libusb_device *dev, libusb_device_handle **devh)
+{
+	*devh = calloc(1, sizeof(struct libusb_device_handle));
+	if (! *devh)
+		return LIBUSB_ERROR_NO_MEM;
+	(*devh)->dev = dev;
+	return 0;
+}
+
+void
+libusb_close(libusb_device_handle *devh)
+{
+	if (! devh)
+		return;
+	pthread_mutex_lock(&devh->dev->mutex);
+	devh->dev->claimed = false;
+	pthread_mutex_unlock(&devh->dev->mutex);
+	free(devh);
+}
+
+int
+libusb_kernel_driver_active(libusb_device_handle *devh, int interface_number)
+{
+	return 0;
+}
+
+int
+libusb_get_configuration(libusb_device_handle *devh, int *config)
+{
+	*config = devh->dev->state.configuration;
+	return 0;
+}
+
+int
+libusb_set_configuration(libusb_device_handle *devh, int configuration)
+{
+	struct libusb_device *dev = devh->dev;
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->claimed)
+		ret = LIBUSB_ERROR_BUSY;
+	else {
+		dev->state.configuration = configuration;
+		dev->alt_setting = 0;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+int
+libusb_claim_interface(libusb_device_handle *devh, int interface_number)
+{
+	struct libusb_device *dev = devh->dev;
+
+	if (interface_number != 0 || dev->state.configuration != 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+	dev->claimed = true;
+	return 0;
+}
+
+int
+libusb_release_interface(libusb_device_handle *devh, int interface_number)
+{
+	devh->dev->claimed = false;
+	return 0;
+}
+
+int
+libusb_set_interface_alt_setting(libusb_device_handle *devh, int interface_number, int alternate_setting)
+{
+	struct libusb_device *dev = devh->dev;
+
+	if (! dev->claimed || interface_number != 0 || alternate_setting > 2)
+		return LIBUSB_ERROR_NOT_FOUND;
+	dev->alt_setting = alternate_setting;
+	return 0;
+}
+
+int
+libusb_reset_device(libusb_device_handle *devh)
+{
+	devh->dev->alt_setting = 0;
+	return 0;
+}
+
+struct libusb_transfer *
+libusb_alloc_transfer(int iso_packets)
+{
+	return calloc(1, sizeof(struct libusb_transfer) +
+		iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+}
+
+void
+libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	if (transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+		free(transfer->buffer);
+	free(transfer);
+}
+
+/* VCO/sub-band (VCO * 16 + sub-band) covering the LO frequency of the PLL setting */
+static int
+fakeusb_vco_band(struct fakeusb_state *state)
+{
+	int r = state->max2163[0x05] << 1 | (state->max2163[0x06] & 0x01);
+	int n = state->max2163[0x07] << 4 | state->max2163[0x08] >> 4;
+	int64_t lo_khz, band;
+
+	if (r == 0)
+		return 0;
+	lo_khz = (int64_t) n * 32000 / r;
+	band = (lo_khz - 470000) * FAKEUSB_VCO_BANDS / 340000;
+	return band < 0 ? 0 : band >= FAKEUSB_VCO_BANDS ? FAKEUSB_VCO_BANDS - 1 : band;
+}
+
+/* Restart the PLL lock after a register it depends on changed */
+static void
+fakeusb_retune(struct fakeusb_state *state)
+{
+	unsigned char vas = state->max2163[0x01], vco = state->max2163[0x02];
+	int target = fakeusb_vco_band(state), loaded = ((vco >> 5) & 0x03) * 16 + ((vco >> 1) & 0x0f);
+	int steps, distance, range = state->max2163[0x03] & 0x07;
+	int r = state->max2163[0x05] << 1 | (state->max2163[0x06] & 0x01);
+	int charge_pump = (vas & 0x10) ? 1 : state->max2163[0x06] >> 6;
+	unsigned int step_time = (14336 + 10240 * (vas & 0x03)) / 32;
+
+	state->tuned_at = fakeusb_now();
+	state->charge_pump = charge_pump;
+	state->unstable = charge_pump > (range < 3 ? 1 : range < 6 ? 2 : 3) ||
+		((vas & 0x20) && r >= FAKEUSB_SLOW_RDIVIDER && (vas & 0x03) == 0);
+	if ((vas & 0x20) == 0) {
+		/* No autoselect: the loaded VCO/sub-band has to be the right one */
+		state->vco_start = state->vco_used = loaded;
+		state->search_time = 0;
+		state->lock_time = loaded == target ? FAKEUSB_SETTLE * 3 / (3 + charge_pump) : UINT_MAX;
+		return;
+	}
+
+	/* START_AT_CURR_LOADED_REGS starts from VCO_REG, otherwise from the last band used */
+	state->vco_start = (vas & 0xc0) == 0x80 ? loaded : state->vco_used;
+	distance = abs(target - state->vco_start);
+	for (steps=1; distance; distance >>= 1)
+		steps++;
+	state->vco_used = target;
+	state->search_time = steps * step_time;
+	state->lock_time = state->search_time + FAKEUSB_SETTLE * 3 / (3 + charge_pump);
+}
+
+/* Apply an OUT command to the device state */
+static void
+fakeusb_command(struct libusb_device *dev, unsigned char *cmd, int size)
+{
+	struct fakeusb_state *state = &dev->state;
+	int i;
+
+	if (size < 8)
+		return;
+	if (! memcmp(&cmd[1], "\x00\x00\x82\x01", 4)) {
+		if (cmd[5] == 0x00 || cmd[5] == 0x15)
+			state->smi[cmd[5] == 0x15][cmd[6]] = cmd[7];
+	} else if (! memcmp(&cmd[1], "\xc0\xc0\x01", 3)) {
+		/* Byte 4 holds the number of registers, whose values follow the first one */
+		bool retune = false;
+
+		for (i=0; i<cmd[4] && 6 + i < size; ++i) {
+			int reg = cmd[5] + i;
+
+			if (reg >= sizeof(state->max2163) || reg == 0x09 || reg == 0x0a)
+				continue;
+			/* A new PLL or VCO setting restarts the lock */
+			if (state->max2163[reg] != cmd[6 + i] && (reg == 0x01 || reg == 0x02 || reg == 0x03 || (reg >= 0x05 && reg <= 0x08)))
+				retune = true;
+			state->max2163[reg] = cmd[6 + i];
+		}
+		if (retune)
+			fakeusb_retune(state);
+	} else if (! memcmp(&cmd[1], "\xee\xc0\x01", 3))
+		state->firmware_chunks++;
+
+	memcpy(dev->last_cmd, cmd, size < FAKEUSB_CMD_SIZE ? size : FAKEUSB_CMD_SIZE);
+}
+
+/* Build the response to an IN request */
+static int
+fakeusb_response(struct libusb_device *dev, uint16_t wValue, unsigned char *buf, int size)
+{
+	struct fakeusb_state *state = &dev->state;
+	unsigned char *cmd = dev->last_cmd;
+	unsigned char resp[FAKEUSB_CMD_SIZE];
+	uint64_t elapsed = fakeusb_now() - state->tuned_at;
+	/* An unstable lock slips one msec out of three */
+	bool locked = elapsed >= state->lock_time && ! (state->unstable && (elapsed / 1000) % 3 == 2);
+	bool searching = elapsed < state->search_time;
+
+	/* Status of the configuration descriptor, see ib200_init_configuration_descriptor() */
+	if (wValue == 0x01) {
+		unsigned char status[2] = { 0x01, 0x03 };
+		memcpy(buf, status, size < 2 ? size : 2);
+		return size < 2 ? size : 2;
+	}
+
+	memcpy(resp, cmd, sizeof(resp));
+	if (! memcmp(&cmd[1], "\x00\x20\x82\x01", 4) && cmd[5] == 0x15)
+		resp[7] = state->smi[1][cmd[6]];
+	else if (! memcmp(&cmd[1], "\xc0\xc0\x01", 3)) {
+		if (cmd[5] == 0x09) {
+			/* Locked: VTUNE ADC in the middle of its range. Otherwise at the rail */
+			resp[6] = (state->pwr_cycle ? 0x01 : 0x00) | state->charge_pump << 1 | (locked ? 3 : 0) << 3;
+			state->pwr_cycle = false;
+		} else if (cmd[5] == 0x0a) {
+			int band = searching ? state->vco_start : state->vco_used;
+			resp[6] = (band / 16) << 6 | (band % 16) << 2 | (searching ? 0x02 : 0x00);
+		} else if (cmd[5] < sizeof(state->max2163))
+			resp[6] = state->max2163[cmd[5]];
+	} else if (! memcmp(&cmd[1], "\xee\xe0\x01", 3) && cmd[5] == 0x32) {
+		static const unsigned char steps[] = { 0x06, 0x07, 0x08, 0x0a };
+		uint64_t synced = elapsed > state->lock_time ? elapsed - state->lock_time : 0;
+
+		if (elapsed < state->lock_time)
+			resp[6] = 0x01;
+		else
+			resp[6] = steps[synced >= FAKEUSB_SYNC_TIME ? 3 : synced * 3 / FAKEUSB_SYNC_TIME];
+	}
+
+	if (size > sizeof(resp))
+		size = sizeof(resp);
+	memcpy(buf, resp, size);
+	return size;
+}
+
+/* Fill an isochronous transfer with null transport stream packets */
+static void
+fakeusb_iso_fill(struct libusb_transfer *transfer)
+{
+	unsigned char *p = transfer->buffer;
+	int i, j;
+
+	for (i=0; i<transfer->num_iso_packets; ++i) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+		for (j=0; j + 188 <= desc->length; j+=188) {
+			memset(p + j, 0xff, 188);
+			p[j] = 0x47;
+			p[j+1] = 0x1f;
+			p[j+2] = 0xff;
+			p[j+3] = 0x10;
+		}
+		desc->actual_length = j;
+		desc->status = LIBUSB_TRANSFER_COMPLETED;
+		p += desc->length;
+	}
+}
+
+int
+libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	struct libusb_context *ctx = dev->ctx;
+	struct fakeusb_pending *pending, **pp;
+	uint64_t now = fakeusb_now();
+
+	pending = malloc(sizeof(*pending));
+	if (! pending)
+		return LIBUSB_ERROR_NO_MEM;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+		unsigned char *data = libusb_control_transfer_get_data(transfer);
+		uint16_t wLength = libusb_le16_to_cpu(setup->wLength);
+
+		/* Requests on EP0 complete in order */
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+			transfer->actual_length = fakeusb_response(dev, libusb_le16_to_cpu(setup->wValue), data, wLength);
+		else {
+			fakeusb_command(dev, data, wLength);
+			transfer->actual_length = wLength;
+		}
+		dev->pipe_free = (dev->pipe_free > now ? dev->pipe_free : now) + ctx->latency;
+		pending->due = dev->pipe_free;
+	} else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		if (dev->alt_setting != 1) {
+			pthread_mutex_unlock(&dev->mutex);
+			free(pending);
+			return LIBUSB_ERROR_IO;
+		}
+		fakeusb_iso_fill(transfer);
+		dev->iso_free = (dev->iso_free > now ? dev->iso_free : now) +
+			transfer->num_iso_packets * FAKEUSB_MICROFRAME;
+		pending->due = dev->iso_free;
+	} else {
+		pthread_mutex_unlock(&dev->mutex);
+		free(pending);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	pending->transfer = transfer;
+
+	pthread_mutex_lock(&ctx->mutex);
+	for (pp=&ctx->pending; *pp && (*pp)->due <= pending->due; pp=&(*pp)->next)
+		;
+	pending->next = *pp;
+	*pp = pending;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+	return 0;
+}
+
+int
+libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/**
+ * Complete the transfers that are due before the timeout expires, sleeping
+ * until the first one is. Returns early once *completed is set, possibly by
+ * another thread handling events.
+ */
+int
+libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+	uint64_t deadline = fakeusb_now() + tv->tv_sec * 1000000 + tv->tv_usec;
+	struct fakeusb_pending *pending;
+	uint64_t now;
+
+	pthread_mutex_lock(&ctx->mutex);
+	while (true) {
+		now = fakeusb_now();
+		if (ctx->pending && ctx->pending->due <= now)
+			break;
+		if (now >= deadline || (completed && *completed)) {
+			pthread_mutex_unlock(&ctx->mutex);
+			return 0;
+		}
+		if (ctx->pending && ctx->pending->due < deadline) {
+			pthread_mutex_unlock(&ctx->mutex);
+			usleep(ctx->pending->due - now);
+			pthread_mutex_lock(&ctx->mutex);
+		} else {
+			struct timespec ts = { deadline / 1000000, (deadline % 1000000) * 1000 };
+			pthread_cond_timedwait(&ctx->cond, &ctx->mutex, &ts);
+		}
+	}
+
+	/* Callbacks run without the lock: they may submit new transfers */
+	while (ctx->pending && ctx->pending->due <= now) {
+		pending = ctx->pending;
+		ctx->pending = pending->next;
+		pthread_mutex_unlock(&ctx->mutex);
+		pending->transfer->callback(pending->transfer);
+		free(pending);
+		pthread_mutex_lock(&ctx->mutex);
+	}
+	/* As libusb does, wake up the threads waiting for events that were just handled here */
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+	return 0;
+}
+
+int
+libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
@@ -0,0 +1,183 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * latency.c - control transfer latency histograms
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "latency.h"
+
+static const char *ib200_space_names[IB200_SPACE_COUNT] = {
+	"0b 00 xx 82 (SMI-2020CBE)",
+	"0b c0 c0 01 (MAX2163)",
+	"0b ee c0 01 (firmware)",
+	"0b ee c4 01 (shadow)",
+	"0b ee e0 01",
+	"other",
+};
+
+/**
+ * Find out which address space a command or response belongs to.
+ * @param cmd command sent or response received
+ * @param length number of bytes in cmd
+ * @return the address space.
+ */
+enum ib200_space
+ib200_space_of(const unsigned char *cmd, int length)
+{
+	if (length < 4 || cmd[0] != 0x0b)
+		return IB200_SPACE_OTHER;
+	if (cmd[1] == 0x00 && cmd[3] == 0x82)
+		return IB200_SPACE_SMI;
+	if (cmd[1] == 0xc0 && cmd[2] == 0xc0 && cmd[3] == 0x01)
+		return IB200_SPACE_MAX2163;
+	if (cmd[1] == 0xee && cmd[3] == 0x01) {
+		switch (cmd[2]) {
+			case 0xc0: return IB200_SPACE_FIRMWARE;
+			case 0xc4: return IB200_SPACE_SHADOW;
+			case 0xe0: return IB200_SPACE_EEE0;
+		}
+	}
+	return IB200_SPACE_OTHER;
+}
+
+const char *
+ib200_space_name(enum ib200_space space)
+{
+	return ib200_space_names[space];
+}
+
+static int
+ib200_histogram_bucket(uint64_t usecs)
+{
+	int msb;
+
+	if (usecs < IB200_LAT_SUB_COUNT)
+		return usecs;
+	if (usecs > UINT32_MAX)
+		usecs = UINT32_MAX;
+
+	msb = 63 - __builtin_clzll(usecs);
+	return IB200_LAT_SUB_COUNT + (msb - IB200_LAT_SUB_BITS) * IB200_LAT_HALF_COUNT +
+		(usecs >> (msb - IB200_LAT_SUB_BITS + 1)) - IB200_LAT_HALF_COUNT;
+}
+
+/* Highest value that falls into a given bucket */
+static uint64_t
+ib200_histogram_value(int bucket)
+{
+	int msb, sub;
+
+	if (bucket < IB200_LAT_SUB_COUNT)
+		return bucket;
+
+	msb = IB200_LAT_SUB_BITS + (bucket - IB200_LAT_SUB_COUNT) / IB200_LAT_HALF_COUNT;
+	sub = IB200_LAT_HALF_COUNT + (bucket - IB200_LAT_SUB_COUNT) % IB200_LAT_HALF_COUNT;
+	return (((uint64_t) sub + 1) << (msb - IB200_LAT_SUB_BITS + 1)) - 1;
+}
+
+/**
+ * Account for a completed control transfer. Lock-free; safe to call from
+ * libusb's completion callbacks.
+ * @param cmd command sent, or response received for IN transfers
+ * @param length number of bytes in cmd
+ * @param in whether this was an IN transfer
+ * @param usecs time from submission to completion
+ */
+void
+ib200_latency_record(struct ib200_latency *latency, const unsigned char *cmd,
+	int length, bool in, uint64_t usecs)
+{
+	struct ib200_histogram *hist = &latency->hist[ib200_space_of(cmd, length)][in];
+	uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&hist->buckets[ib200_histogram_bucket(usecs)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum, usecs, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	while (usecs > max &&
+		! atomic_compare_exchange_weak_explicit(&hist->max, &max, usecs,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/**
+ * Query a histogram.
+ * @param percentile between 0 and 100
+ * @return the latency, in usecs, below which the given percentage of the
+ * transfers completed, or 0 if the histogram is empty.
+ */
+uint64_t
+ib200_histogram_percentile(struct ib200_histogram *hist, double percentile)
+{
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	uint64_t wanted, seen = 0;
+	int i;
+
+	if (count == 0)
+		return 0;
+
+	wanted = (uint64_t) (percentile / 100.0 * count + 0.5);
+	if (wanted < 1)
+		wanted = 1;
+	for (i=0; i<IB200_LAT_BUCKETS; ++i) {
+		seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		if (seen >= wanted)
+			return ib200_histogram_value(i) < max ? ib200_histogram_value(i) : max;
+	}
+	return max;
+}
+
+/**
+ * Print a summary of every address space that saw any traffic.
+ * @param fp output stream
+ */
+void
+ib200_latency_print(struct ib200_latency *latency, FILE *fp)
+{
+	int space, in;
+
+	fprintf(fp, "%-27s %-3s %8s %8s %8s %8s %8s %8s %8s\n", "address space", "dir",
+		"count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (space=0; space<IB200_SPACE_COUNT; ++space)
+		for (in=0; in<2; ++in) {
+			struct ib200_histogram *hist = &latency->hist[space][in];
+			uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+
+			if (count == 0)
+				continue;
+			fprintf(fp, "%-27s %-3s %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+				ib200_space_name(space), in ? "in" : "out",
+				(unsigned long long) count,
+				(unsigned long long) (atomic_load_explicit(&hist->sum, memory_order_relaxed) / count),
+				(unsigned long long) ib200_histogram_percentile(hist, 50),
+				(unsigned long long) ib200_histogram_percentile(hist, 90),
+				(unsigned long long) ib200_histogram_percentile(hist, 99),
+				(unsigned long long) ib200_histogram_percentile(hist, 99.9),
+				(unsigned long long) atomic_load_explicit(&hist->max, memory_order_relaxed));
+		}
+	fprintf(fp, "(latencies in usecs, from submission to completion)\n");
+	fflush(fp);
+}
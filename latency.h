@@ -0,0 +1,75 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * latency.h - control transfer latency histograms
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#ifndef __latency_h
+#define __latency_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/**
+ * Log-linear buckets, as in HDR histograms: values below 2^IB200_LAT_SUB_BITS
+ * usecs get a bucket each, larger ones get 2^(IB200_LAT_SUB_BITS-1) buckets
+ * per power of two. That keeps the relative error under 1/16 from 1 usec up
+ * to more than an hour.
+ */
+#define IB200_LAT_SUB_BITS   5
+#define IB200_LAT_SUB_COUNT  (1 << IB200_LAT_SUB_BITS)
+#define IB200_LAT_HALF_COUNT (IB200_LAT_SUB_COUNT / 2)
+#define IB200_LAT_BUCKETS    (IB200_LAT_SUB_COUNT + (32 - IB200_LAT_SUB_BITS) * IB200_LAT_HALF_COUNT)
+
+/* Address spaces of the bridge, as selected by the first 4 bytes of a command */
+enum ib200_space {
+	IB200_SPACE_SMI,        /* 0b 00 xx 82: SMI-2020CBE */
+	IB200_SPACE_MAX2163,    /* 0b c0 c0 01: MAX2163 I2C registers */
+	IB200_SPACE_FIRMWARE,   /* 0b ee c0 01: firmware upload */
+	IB200_SPACE_SHADOW,     /* 0b ee c4 01: shadow registers */
+	IB200_SPACE_EEE0,       /* 0b ee e0 01: unknown, perhaps the MA50159 */
+	IB200_SPACE_OTHER,
+	IB200_SPACE_COUNT,
+};
+
+struct ib200_histogram {
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum;      /* in usecs */
+	atomic_uint_fast64_t max;      /* in usecs */
+	atomic_uint_fast32_t buckets[IB200_LAT_BUCKETS];
+};
+
+/* Histograms of every address space, for OUT commands and IN responses */
+struct ib200_latency {
+	struct ib200_histogram hist[IB200_SPACE_COUNT][2];
+};
+
+enum ib200_space ib200_space_of(const unsigned char *cmd, int length);
+const char *ib200_space_name(enum ib200_space space);
+
+void ib200_latency_record(struct ib200_latency *latency, const unsigned char *cmd,
+	int length, bool in, uint64_t usecs);
+uint64_t ib200_histogram_percentile(struct ib200_histogram *hist, double percentile);
+void ib200_latency_print(struct ib200_latency *latency, FILE *fp);
+
+#endif /* __latency_h */
@@ -28,6 +28,7 @@
 
 #define MAX2163_I2C_WRITE_ADDR                 0xc0 /* may also be 0xc2 */
 #define MAX2163_I2C_READ_ADDR                  0xc1 /* may also be 0xc3 */
+#define MAX2163_NUM_REGS                       0x17 /* registers 0x00 to 0x16 */
 
 #define RDIVIDER_LSB_MASK      0x01
 #define NDIVIDER_LSB_MASK      0xf0
@@ -70,6 +71,10 @@
 #define ENABLE_VCO_AUTOSELECT        (1 << 5)
 #define START_AT_CURR_LOADED_REGS    (2 << 6)
 #define START_AT_CURR_USED_REGS      (3 << 6)
+#define AUTOSELECT_WAIT_TIME_MASK    0x03
+#define CPS_MASK                     0x10
+#define VCO_AUTOSELECT_MASK          0x20
+#define VAS_START_MASK               0xc0
 
 #define VCO_REG                      0x02
 #define VCOB_NORMAL_POWER           (0 << 0)
@@ -95,6 +100,8 @@
 #define VCO_2                       (2 << 5)
 #define VCO_REG_NOT_USED            (3 << 5)
 #define VCO_FACTORY_USE_ONLY        (1 << 7)
+#define SUB_BAND_MASK               0x1e
+#define VCO_MASK                    0x60
 
 #define RF_FILTER_REG               0x03
 #define FREQ_RANGE_MASK             0xf0
@@ -118,6 +125,9 @@
 #define PWRDET_BUF_ON_RFAGC        (1 << 6)
 #define UNUSED                     (2 << 6)
 #define PWRDET_BUF_ON_GC1          (3 << 6)
+#define UHF_RANGE_MASK             0x07
+#define AGC_MASK                   0x38
+#define PWRDET_BUF_MASK            0xc0
 
 #define MODE_REG                   0x04
 #define MODE_REG_FACTORY_USE       0x1f
@@ -135,6 +145,8 @@
  * All bits are used to set the PLL reference divider (R) number.
  * default R divide value is 126 decimal. R can range from 16 to 511 decimal.
  */
+#define RDIVIDER_MIN               16
+#define RDIVIDER_MAX               511
 
 #define RDIVIDER_LSB_REG                   0x06
 #define RDIVIDER_LSB_REG_FACTORY_USE_1    (1 << 1)
@@ -149,6 +161,7 @@
 #define CHARGE_PUMP_2MA                   (1 << 6)
 #define CHARGE_PUMP_2_5MA                 (2 << 6)
 #define CHARGE_PUMP_3MA                   (3 << 6)
+#define CHARGE_PUMP_MASK                  0xc0
 
 #define PLL_MOST_RDIVIDER(num)    ((num >> 1) & 0xff)
 #define PLL_LEAST_RDIVIDER(num)   (num & RDIVIDER_LSB_MASK)
@@ -159,6 +172,8 @@
  * divide number (N). Default integer divide value is N = 1952 decimal. N 
  * can range from 1314 to 2687.
  */
+#define NDIVIDER_MIN               1314
+#define NDIVIDER_MAX               2687
 
 #define NDIVIDER_LSB_REG               0x08
 #define STBY_NORMAL                   (0 << 0)
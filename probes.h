@@ -0,0 +1,64 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * probes.h - USDT static tracepoints
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#ifndef __probes_h
+#define __probes_h
+
+/**
+ * Static probes of the "zinwell" provider. A disabled probe is a single nop
+ * in the instruction stream. List them with
+ *   bpftrace -l 'usdt:./zinwell:*'
+ * and, for instance, measure the latency of each vendor request with
+ *   bpftrace -e 'usdt:./zinwell:zinwell:cmd__complete { @[arg1] = hist(arg4); }'
+ *
+ * Commands are passed as a pointer plus a length; read them with buf().
+ *
+ *  cmd__submit(cmd, size, bmRequestType)          vendor request queued on EP0
+ *  cmd__complete(cmd, prefix, status, length, latency_us)
+ *  i2c__write(cmd, size, ret)                     MAX2163 register write(s)
+ *  shadow__write(cmd, size, ret)
+ *  endpoint__write(cmd, size, ret)
+ *  usb__out(cmd, size, ret)
+ *  usb__in(response, size, ret)
+ *  set_frequency__entry(channel)
+ *  set_frequency__return(channel, n_divider, ret)
+ *  pll__lock(polls, lock_time_us, ret)            end of --wait-lock
+ *  iso__submit(transfer, num_packets, packet_size, ret)
+ *  iso__complete(transfer, status, length, num_packets, latency_us)
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define IB200_PROBE1(name, a)                DTRACE_PROBE1(zinwell, name, a)
+#define IB200_PROBE3(name, a, b, c)          DTRACE_PROBE3(zinwell, name, a, b, c)
+#define IB200_PROBE4(name, a, b, c, d)       DTRACE_PROBE4(zinwell, name, a, b, c, d)
+#define IB200_PROBE5(name, a, b, c, d, e)    DTRACE_PROBE5(zinwell, name, a, b, c, d, e)
+#else
+#define IB200_PROBE1(name, a)                do { } while (0)
+#define IB200_PROBE3(name, a, b, c)          do { } while (0)
+#define IB200_PROBE4(name, a, b, c, d)       do { } while (0)
+#define IB200_PROBE5(name, a, b, c, d, e)    do { } while (0)
+#endif
+
+#endif /* __probes_h */
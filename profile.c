@@ -0,0 +1,202 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * profile.c - what the driver learned about the tuner of a device
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "profile.h"
+
+/**
+ * Load a profile written by ib200_profile_save(). Each line holds a record:
+ *   V <channel> <VCO> <sub-band>    VCO and sub-band the PLL locked with
+ *   P <band> <charge pump> <VAS wait time> <lock time>
+ *                                   PLL setting of a UHF_RANGE_* band; the charge
+ *                                   pump is A for CPS_AUTOMATIC
+ * A missing file gives an empty profile, to be learned from scratch.
+ * @param path file to load
+ * @param profile output
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_profile_load(const char *path, struct ib200_profile *profile)
+{
+	char line[256], charge_pump[8];
+	int number, vco, subband, band, wait_time, lineno = 0;
+	unsigned int lock_time;
+	struct ib200_pll_setting setting;
+	FILE *fp;
+
+	memset(profile, 0, sizeof(*profile));
+	fp = fopen(path, "r");
+	if (! fp) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char type;
+
+		lineno++;
+		if (sscanf(line, " %c", &type) != 1 || type == '#')
+			continue;
+		if (type == 'V' && sscanf(line, " V %d %d %d", &number, &vco, &subband) == 3 &&
+				vco >= 0 && vco <= 2 && subband >= 0 && subband <= 15 &&
+				number >= IB200_CHANNEL_MIN && number <= IB200_CHANNEL_MAX) {
+			ib200_profile_set_vco(profile, number, vco, subband);
+			continue;
+		}
+		if (type == 'P' && sscanf(line, " P %d %7s %d %u", &band, charge_pump, &wait_time, &lock_time) == 4 &&
+				band >= 0 && band < IB200_BAND_COUNT && wait_time >= 0 && wait_time <= 3 &&
+				(! strcmp(charge_pump, "A") || (charge_pump[0] >= '0' && charge_pump[0] <= '3' && ! charge_pump[1]))) {
+			setting.valid = true;
+			setting.cps_automatic = charge_pump[0] == 'A';
+			setting.charge_pump = setting.cps_automatic ? 0 : charge_pump[0] - '0';
+			setting.wait_time = wait_time;
+			setting.lock_time = lock_time;
+			ib200_profile_set_pll(profile, band, &setting);
+			continue;
+		}
+		fprintf(stderr, "%s:%d: ignoring malformed profile entry\n", path, lineno);
+	}
+
+	fclose(fp);
+	profile->dirty = false;
+	return 0;
+}
+
+/**
+ * Write a profile out, if it changed since it was loaded.
+ * @param path file to write
+ * @param profile profile to write
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_profile_save(const char *path, struct ib200_profile *profile)
+{
+	int i;
+	FILE *fp;
+
+	if (! profile->dirty)
+		return 0;
+
+	fp = fopen(path, "w");
+	if (! fp) {
+		perror(path);
+		return -errno;
+	}
+
+	fprintf(fp, "# MAX2163 VCO and sub-band locked on, per channel\n");
+	for (i=0; i<IB200_CHANNEL_COUNT; ++i)
+		if (profile->vco[i].valid)
+			fprintf(fp, "V %d %d %d\n", IB200_CHANNEL_MIN + i, profile->vco[i].vco, profile->vco[i].subband);
+
+	fprintf(fp, "# Charge pump (A: automatic), VAS wait time and lock time, per UHF band\n");
+	for (i=0; i<IB200_BAND_COUNT; ++i)
+		if (profile->pll[i].valid) {
+			if (profile->pll[i].cps_automatic)
+				fprintf(fp, "P %d A", i);
+			else
+				fprintf(fp, "P %d %d", i, profile->pll[i].charge_pump);
+			fprintf(fp, " %d %u\n", profile->pll[i].wait_time, profile->pll[i].lock_time);
+		}
+
+	if (fclose(fp) != 0) {
+		perror(path);
+		return -errno;
+	}
+	profile->dirty = false;
+	return 0;
+}
+
+/**
+ * Look up the VCO and sub-band learned for a channel.
+ * @return the choice, or NULL if the channel was never locked on.
+ */
+const struct ib200_vco_choice *
+ib200_profile_get_vco(const struct ib200_profile *profile, int number)
+{
+	const struct ib200_vco_choice *choice;
+
+	if (number < IB200_CHANNEL_MIN || number > IB200_CHANNEL_MAX)
+		return NULL;
+	choice = &profile->vco[number - IB200_CHANNEL_MIN];
+	return choice->valid ? choice : NULL;
+}
+
+/* Remember the VCO and sub-band a channel locked with */
+void
+ib200_profile_set_vco(struct ib200_profile *profile, int number, int vco, int subband)
+{
+	struct ib200_vco_choice *choice;
+
+	if (number < IB200_CHANNEL_MIN || number > IB200_CHANNEL_MAX)
+		return;
+	choice = &profile->vco[number - IB200_CHANNEL_MIN];
+	if (choice->valid && choice->vco == vco && choice->subband == subband)
+		return;
+	choice->valid = true;
+	choice->vco = vco;
+	choice->subband = subband;
+	profile->dirty = true;
+}
+
+/* Drop what was learned about a channel, e.g. because it no longer locks */
+void
+ib200_profile_forget_vco(struct ib200_profile *profile, int number)
+{
+	if (number < IB200_CHANNEL_MIN || number > IB200_CHANNEL_MAX)
+		return;
+	if (profile->vco[number - IB200_CHANNEL_MIN].valid)
+		profile->dirty = true;
+	profile->vco[number - IB200_CHANNEL_MIN].valid = false;
+}
+
+/**
+ * Look up the PLL setting calibrated for a band.
+ * @param band UHF_RANGE_* value
+ * @return the setting, or NULL if the band was not calibrated.
+ */
+const struct ib200_pll_setting *
+ib200_profile_get_pll(const struct ib200_profile *profile, int band)
+{
+	if (band < 0 || band >= IB200_BAND_COUNT || ! profile->pll[band].valid)
+		return NULL;
+	return &profile->pll[band];
+}
+
+/* Store the PLL setting of a band */
+void
+ib200_profile_set_pll(struct ib200_profile *profile, int band, const struct ib200_pll_setting *setting)
+{
+	if (band < 0 || band >= IB200_BAND_COUNT)
+		return;
+	profile->pll[band] = *setting;
+	profile->pll[band].valid = true;
+	profile->dirty = true;
+}
@@ -0,0 +1,63 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * profile.h - what the driver learned about the tuner of a device
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#ifndef __profile_h
+#define __profile_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "channels.h"
+
+/* VCO and sub-band the MAX2163 autoselect settled on for a channel */
+struct ib200_vco_choice {
+	bool valid;
+	unsigned char vco;                      /* VCO_AUTOSELECT of VAS_STATUS_REG, 0 to 2 */
+	unsigned char subband;                  /* VCO_SUBBAND of VAS_STATUS_REG, 0 to 15 */
+};
+
+/* Charge pump and VAS wait time that lock fastest, and for good, in a UHF band */
+struct ib200_pll_setting {
+	bool valid;
+	bool cps_automatic;                     /* CPS_AUTOMATIC, rather than charge_pump */
+	unsigned char charge_pump;              /* CHARGE_PUMP_* >> 6 */
+	unsigned char wait_time;                /* AUTOSELECT_*_WAIT_TIME */
+	uint32_t lock_time;                     /* as calibrated, in usecs */
+};
+
+struct ib200_profile {
+	struct ib200_vco_choice vco[IB200_CHANNEL_COUNT];  /* indexed by channel number - IB200_CHANNEL_MIN */
+	struct ib200_pll_setting pll[IB200_BAND_COUNT];    /* indexed by UHF_RANGE_* */
+	bool dirty;                             /* changed since loaded */
+};
+
+int ib200_profile_load(const char *path, struct ib200_profile *profile);
+int ib200_profile_save(const char *path, struct ib200_profile *profile);
+const struct ib200_vco_choice *ib200_profile_get_vco(const struct ib200_profile *profile, int number);
+void ib200_profile_set_vco(struct ib200_profile *profile, int number, int vco, int subband);
+void ib200_profile_forget_vco(struct ib200_profile *profile, int number);
+const struct ib200_pll_setting *ib200_profile_get_pll(const struct ib200_profile *profile, int band);
+void ib200_profile_set_pll(struct ib200_profile *profile, int band, const struct ib200_pll_setting *setting);
+
+#endif /* __profile_h */
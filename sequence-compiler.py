@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+
+#
+# Compiles the UsbSnoop captures in logs/Log into sequence files that
+# zinwell --sequence can replay (see sequence.h for the format).
+#
+# Every 13-byte vendor request of the capture becomes a step. The settle time
+# of a step is the gap the Windows driver left between its completion and the
+# next vendor request. IN steps keep the response seen in the capture; by
+# default only the bytes that echo the preceding OUT command are compared, as
+# the others carry register values. Use --strict to compare whole responses.
+#
+# Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+#  any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+import os
+import struct
+from usbsnoop import UsbSnoopLog
+
+MAGIC = b"IB200SEQ"
+VERSION = 1
+CMD_SIZE = 13
+OP_OUT = 1
+OP_IN = 2
+
+class SequenceCompiler :
+	def __init__(self, filename, strict=False) :
+		self.filename = filename
+		self.strict = strict
+		self.steps = []
+		self.skipped = 0
+
+	def compileSteps(self) :
+		urbs = [urb for urb in UsbSnoopLog(self.filename).urbs() if urb.isVendor()]
+		last_out = None
+		for this, following in zip(urbs, urbs[1:] + [None]) :
+			data = this.data()
+			if len(data) != CMD_SIZE :
+				self.skipped += 1
+				continue
+
+			delay = 0
+			if following is not None and this.t_up is not None :
+				delay = max(following.t_down - this.t_up, 0) * 1000
+
+			if this.direction_in :
+				if self.strict or last_out is None :
+					mask = [0xff] * CMD_SIZE
+				else :
+					mask = [0xff if a == b else 0x00 for a, b in zip(data, last_out)]
+				self.steps.append((OP_IN, data, mask, delay))
+			else :
+				self.steps.append((OP_OUT, data, [0] * CMD_SIZE, delay))
+				last_out = data
+
+	def writeSequence(self, outfile) :
+		fp = open(outfile, "wb")
+		fp.write(MAGIC + struct.pack("<B3xI", VERSION, len(self.steps)))
+		for op, data, mask, delay in self.steps :
+			fp.write(struct.pack("<B", op) + bytes(data) + bytes(mask) + struct.pack("<I", delay))
+		fp.close()
+
+
+args = os.sys.argv[1:]
+strict = "--strict" in args
+if strict :
+	args.remove("--strict")
+
+if len(args) != 2 :
+	print("Syntax: %s [--strict] <capture.log.bz2> <output.seq>" % os.sys.argv[0])
+	os.sys.exit(1)
+
+sc = SequenceCompiler(args[0], strict)
+sc.compileSteps()
+sc.writeSequence(args[1])
+print("%s: %d steps, %d vendor requests of other sizes skipped" % (args[1], len(sc.steps), sc.skipped))
@@ -0,0 +1,79 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * sequence.h - vendor command sequences
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#ifndef __sequence_h
+#define __sequence_h
+
+#include <stdint.h>
+
+/**
+ * A sequence is a list of 13-byte vendor commands to send (OUT steps) and of
+ * responses to read back (IN steps). The first byte of each command is also
+ * its wValue. An IN step holds the expected response and a mask of the bits
+ * that must match; the other bits (register values, counters) are ignored.
+ *
+ * Sequence files hold a 16-byte header followed by the steps:
+ *
+ *   offset size
+ *        0    8  magic, "IB200SEQ"
+ *        8    1  version, 1
+ *        9    3  reserved, 0
+ *       12    4  number of steps (little-endian)
+ *
+ * and then, for each step:
+ *
+ *        0    1  op: 1 = OUT, 2 = IN
+ *        1   13  command, or expected response
+ *       14   13  mask of the response bits to compare (ignored by OUT steps)
+ *       27    4  settle time after the step in usecs (little-endian);
+ *                0xffffffff picks the one in delays.h
+ */
+#define IB200_SEQ_MAGIC        "IB200SEQ"
+#define IB200_SEQ_VERSION      1
+#define IB200_SEQ_HEADER_SIZE  16
+#define IB200_SEQ_STEP_SIZE    31
+#define IB200_SEQ_CMD_SIZE     13
+#define IB200_SEQ_DELAY_AUTO   0xffffffff
+
+enum ib200_seq_opcode {
+	IB200_SEQ_OUT = 1,
+	IB200_SEQ_IN  = 2,
+};
+
+struct ib200_seq_op {
+	uint8_t op;
+	unsigned char data[IB200_SEQ_CMD_SIZE];
+	unsigned char mask[IB200_SEQ_CMD_SIZE];
+	uint32_t delay;
+};
+
+/* Helpers for writing sequences in C */
+#define SEQ_OUT(bytes...)      { IB200_SEQ_OUT, { bytes }, { 0 }, IB200_SEQ_DELAY_AUTO }
+#define SEQ_IN(mask, bytes...) { IB200_SEQ_IN, { bytes }, mask, IB200_SEQ_DELAY_AUTO }
+
+/* Compare the whole response, or all of it but one register value */
+#define SEQ_MASK_ALL           { [0 ... IB200_SEQ_CMD_SIZE-1] = 0xff }
+#define SEQ_MASK_BUT(n)        { [0 ... (n)-1] = 0xff, [(n)+1 ... IB200_SEQ_CMD_SIZE-1] = 0xff }
+
+#endif /* __sequence_h */
@@ -0,0 +1,197 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * trace.c - in-memory trace of the USB transfers
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+#define IB200_TRACE_MASK (IB200_TRACE_RECORDS - 1)
+
+/**
+ * Append a completed transfer to the ring. Safe to call from any thread,
+ * including libusb's completion callbacks.
+ * @param data bytes transferred; at most IB200_TRACE_DATA_SIZE are kept
+ * @param length number of bytes transferred
+ * @param start submission time, in usecs
+ * @param end completion time, in usecs
+ */
+void
+ib200_trace_record(struct ib200_trace *trace, enum ib200_trace_type type,
+	uint8_t bmRequestType, uint16_t wValue, const unsigned char *data, uint32_t length,
+	int status, uint64_t start, uint64_t end)
+{
+	uint64_t idx = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+	struct ib200_trace_record *rec = &trace->records[idx & IB200_TRACE_MASK];
+	uint32_t n = length < IB200_TRACE_DATA_SIZE ? length : IB200_TRACE_DATA_SIZE;
+
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	rec->timestamp = start;
+	rec->latency = end > start ? end - start : 0;
+	rec->length = length;
+	rec->status = status;
+	rec->type = type;
+	rec->bmRequestType = bmRequestType;
+	rec->wValue = wValue;
+	if (data)
+		memcpy(rec->data, data, n);
+	memset(rec->data + n, 0, IB200_TRACE_DATA_SIZE - n);
+
+	atomic_store_explicit(&rec->seq, idx + 1, memory_order_release);
+}
+
+/**
+ * Take a consistent copy of the record at a given position of the ring.
+ * @return 0 on success or -1 if the record was overwritten meanwhile.
+ */
+static int
+ib200_trace_copy(struct ib200_trace *trace, uint64_t idx, struct ib200_trace_record *out)
+{
+	struct ib200_trace_record *rec = &trace->records[idx & IB200_TRACE_MASK];
+	uint64_t seq;
+
+	seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+	if (seq != idx + 1)
+		return -1;
+
+	out->timestamp = rec->timestamp;
+	out->latency = rec->latency;
+	out->length = rec->length;
+	out->status = rec->status;
+	out->type = rec->type;
+	out->bmRequestType = rec->bmRequestType;
+	out->wValue = rec->wValue;
+	memcpy(out->data, rec->data, IB200_TRACE_DATA_SIZE);
+
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&rec->seq, memory_order_relaxed) != seq)
+		return -1;
+	return 0;
+}
+
+static void
+ib200_trace_hex(FILE *fp, struct ib200_trace_record *rec, const char *sep)
+{
+	int i, n = rec->length < IB200_TRACE_DATA_SIZE ? rec->length : IB200_TRACE_DATA_SIZE;
+
+	for (i=0; i<n; ++i)
+		fprintf(fp, "%s%02x", i ? sep : "", rec->data[i]);
+}
+
+/* Mimics the subset of the UsbSnoop output that usbsnoop.py understands */
+static void
+ib200_trace_dump_text(FILE *fp, uint64_t urb, struct ib200_trace_record *rec)
+{
+	bool in = rec->type != IB200_TRACE_CTRL_OUT;
+	const char *direction = in ? "USBD_TRANSFER_DIRECTION_IN" : "USBD_TRANSFER_DIRECTION_OUT";
+	unsigned long long t_down = rec->timestamp / 1000;
+	unsigned long long t_up = (rec->timestamp + rec->latency) / 1000;
+
+	fprintf(fp, "[%llu ms]  >>>  URB %llu going down  >>> \n", t_down, (unsigned long long) urb);
+	if (rec->type == IB200_TRACE_ISO) {
+		fprintf(fp, "-- URB_FUNCTION_ISOCH_TRANSFER:\n");
+		fprintf(fp, "  TransferFlags          = 00000003 (%s, USBD_SHORT_TRANSFER_OK)\n", direction);
+	} else {
+		fprintf(fp, "-- URB_FUNCTION_VENDOR_DEVICE:\n");
+		fprintf(fp, "  TransferFlags          = %08x (%s, USBD_SHORT_TRANSFER_OK)\n", in ? 3 : 2, direction);
+		fprintf(fp, "  TransferBufferLength = %08x\n", rec->length);
+		if (! in) {
+			fprintf(fp, "    00000000: ");
+			ib200_trace_hex(fp, rec, " ");
+			fprintf(fp, "\n");
+		}
+		fprintf(fp, "  Request                 = 00000001\n");
+		fprintf(fp, "  Value                   = %08x\n", rec->wValue);
+		fprintf(fp, "  Index                   = 00000000\n");
+	}
+
+	fprintf(fp, "[%llu ms]  <<<  URB %llu coming back  <<< \n", t_up, (unsigned long long) urb);
+	fprintf(fp, "-- %s:\n", rec->type == IB200_TRACE_ISO ? "URB_FUNCTION_ISOCH_TRANSFER" : "URB_FUNCTION_CONTROL_TRANSFER");
+	fprintf(fp, "  TransferFlags        = %08x (%s, USBD_SHORT_TRANSFER_OK)\n", in ? 0xb : 0xa, direction);
+	fprintf(fp, "  TransferBufferLength = %08x\n", rec->length);
+	if (in && rec->length) {
+		fprintf(fp, "    00000000: ");
+		ib200_trace_hex(fp, rec, " ");
+		fprintf(fp, "\n");
+	}
+	if (rec->status)
+		fprintf(fp, "  Status               = %d\n", rec->status);
+}
+
+static void
+ib200_trace_dump_chrome(FILE *fp, bool first, struct ib200_trace_record *rec)
+{
+	static const char *lanes[] = { "control out", "control in", "isochronous" };
+
+	fprintf(fp, "%s{\"name\":\"", first ? "" : ",\n");
+	if (rec->type == IB200_TRACE_ISO)
+		fprintf(fp, "iso");
+	else
+		fprintf(fp, "%02x %02x %02x %02x", rec->data[0], rec->data[1], rec->data[2], rec->data[3]);
+	fprintf(fp, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"lane\":\"%s\",\"status\":%d,\"length\":%u,\"data\":\"",
+		rec->type == IB200_TRACE_ISO ? "iso" : "control",
+		(unsigned long long) rec->timestamp, rec->latency, rec->type + 1,
+		lanes[rec->type], rec->status, rec->length);
+	ib200_trace_hex(fp, rec, " ");
+	fprintf(fp, "\"}}");
+}
+
+/**
+ * Write the records currently in the ring, oldest first.
+ * @param fp output stream
+ * @param format output format
+ * @return the number of records written.
+ */
+int
+ib200_trace_dump(struct ib200_trace *trace, FILE *fp, enum ib200_trace_format format)
+{
+	struct ib200_trace_record rec;
+	uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+	uint64_t idx = head > IB200_TRACE_RECORDS ? head - IB200_TRACE_RECORDS : 0;
+	int count = 0;
+
+	if (format == IB200_TRACE_CHROME)
+		fprintf(fp, "{\"traceEvents\":[\n");
+
+	for (; idx < head; ++idx) {
+		if (ib200_trace_copy(trace, idx, &rec) < 0)
+			continue;
+		if (format == IB200_TRACE_CHROME)
+			ib200_trace_dump_chrome(fp, count == 0, &rec);
+		else
+			ib200_trace_dump_text(fp, idx, &rec);
+		count++;
+	}
+
+	if (format == IB200_TRACE_CHROME)
+		fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fflush(fp);
+	return count;
+}
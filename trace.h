@@ -0,0 +1,79 @@
+/**
+ * ISDB-T 1Seg DTV USB device driver
+ * IBAYO IB-200 / ZIROK DTV-1 - Zinwell chipset
+ * trace.h - in-memory trace of the USB transfers
+ *
+ * Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * For more information on this project, please visit the following URL:
+ * http://groups.fsf.org/wiki/LinuxLibre:ISDB_USB_ZINWELL
+ */
+#ifndef __trace_h
+#define __trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define IB200_TRACE_RECORDS    4096    /* must be a power of 2 */
+#define IB200_TRACE_DATA_SIZE  13
+
+enum ib200_trace_type {
+	IB200_TRACE_CTRL_OUT,
+	IB200_TRACE_CTRL_IN,
+	IB200_TRACE_ISO,
+};
+
+enum ib200_trace_format {
+	IB200_TRACE_TEXT,     /* UsbSnoop-like, diffable against logs/Log */
+	IB200_TRACE_CHROME,   /* Chrome trace-event JSON (chrome://tracing, Perfetto) */
+};
+
+/**
+ * A completed transfer. For control OUT transfers data[] holds the command
+ * sent, for control IN transfers the response received and for isochronous
+ * transfers the first bytes of the first packet.
+ */
+struct ib200_trace_record {
+	atomic_uint_fast64_t seq;   /* position in the ring + 1, 0 while being written */
+	uint64_t timestamp;         /* submission time, in usecs */
+	uint32_t latency;           /* from submission to completion, in usecs */
+	uint32_t length;            /* bytes actually transferred */
+	int16_t status;             /* 0 or a negative LIBUSB_ERROR code */
+	uint8_t type;               /* enum ib200_trace_type */
+	uint8_t bmRequestType;
+	uint16_t wValue;
+	unsigned char data[IB200_TRACE_DATA_SIZE];
+};
+
+/**
+ * Fixed-size ring of the last IB200_TRACE_RECORDS transfers. Writers never
+ * block: they reserve a slot with an atomic increment and overwrite the
+ * oldest record. Readers skip records that are overwritten while copied.
+ */
+struct ib200_trace {
+	atomic_uint_fast64_t head;
+	struct ib200_trace_record records[IB200_TRACE_RECORDS];
+};
+
+void ib200_trace_record(struct ib200_trace *trace, enum ib200_trace_type type,
+	uint8_t bmRequestType, uint16_t wValue, const unsigned char *data, uint32_t length,
+	int status, uint64_t start, uint64_t end);
+
+int ib200_trace_dump(struct ib200_trace *trace, FILE *fp, enum ib200_trace_format format);
+
+#endif /* __trace_h */
@@ -0,0 +1,137 @@
+#
+# Parser for the UsbSnoop captures found in logs/Log.
+#
+# Copyright (c) 2010, Lucas C. Villa Real <lucasvr@gobolinux.org>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+#  any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+import bz2
+import re
+
+timestamp_re = re.compile(r"^\[(\d+) ms\]")
+down_re = re.compile(r">>>\s+URB (\d+) going down\s+>>>")
+up_re = re.compile(r"<<<\s+URB (\d+) coming back\s+<<<")
+function_re = re.compile(r"^-- (URB_FUNCTION_\w+):")
+field_re = re.compile(r"^\s+(\w+)\s+=\s+([0-9a-fA-F]+)")
+hex_re = re.compile(r"^\s+[0-9a-fA-F]{8}: ((?:[0-9a-fA-F]{2} ?)+)")
+
+class Urb :
+	def __init__(self, number, t_down) :
+		self.number = number
+		self.function = None
+		self.direction_in = False
+		self.request = None
+		self.value = None
+		self.index = None
+		self.length = 0
+		self.out_data = []
+		self.in_data = []
+		self.t_down = t_down
+		self.t_up = None
+
+	def isVendor(self) :
+		return self.function == "URB_FUNCTION_VENDOR_DEVICE"
+
+	def data(self) :
+		if self.direction_in :
+			return self.in_data
+		return self.out_data
+
+	def prefix(self) :
+		return tuple(self.data()[:4])
+
+class UsbSnoopLog :
+	def __init__(self, filename) :
+		self.filename = filename
+
+	def open(self) :
+		if self.filename.endswith(".bz2") :
+			return bz2.open(self.filename, "rt", errors="replace")
+		return open(self.filename, errors="replace")
+
+	def urbs(self) :
+		""" Returns the URBs of the capture, in the order they went down the stack """
+		result = []
+		pending = {}
+		urb = None
+		going_down = False
+		in_setup = False
+		now = 0
+
+		fp = self.open()
+		for line in fp :
+			match = timestamp_re.match(line)
+			if match :
+				now = int(match.group(1))
+
+			match = down_re.search(line)
+			if match :
+				urb = Urb(int(match.group(1)), now)
+				pending[urb.number] = urb
+				result.append(urb)
+				going_down = True
+				in_setup = False
+				continue
+
+			match = up_re.search(line)
+			if match :
+				urb = pending.pop(int(match.group(1)), None)
+				if urb :
+					urb.t_up = now
+				going_down = False
+				in_setup = False
+				continue
+
+			if urb is None :
+				continue
+
+			match = function_re.match(line)
+			if match :
+				if going_down :
+					urb.function = match.group(1)
+				continue
+
+			if "SetupPacket" in line :
+				in_setup = True
+				continue
+
+			match = hex_re.match(line)
+			if match :
+				if in_setup :
+					continue
+				data = [int(x, 16) for x in match.group(1).split()]
+				if going_down :
+					urb.out_data += data
+				else :
+					urb.in_data += data
+				continue
+
+			match = field_re.match(line)
+			if match and going_down :
+				name, value = match.group(1), int(match.group(2), 16)
+				if name == "TransferFlags" :
+					urb.direction_in = (value & 1) == 1
+				elif name == "TransferBufferLength" :
+					urb.length = value
+				elif name == "Request" :
+					urb.request = value
+				elif name == "Value" :
+					urb.value = value
+				elif name == "Index" :
+					urb.index = value
+
+		fp.close()
+		return result
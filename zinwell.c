@@ -32,18 +32,29 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libusb.h>
 
 #include "max2163.h"
+#include "sequence.h"
+#include "delays.h"
+#include "trace.h"
+#include "latency.h"
+#include "channels.h"
+#include "profile.h"
+#include "probes.h"
 #include "debug.h"
 
 #define ZINWELL_VENDOR_ID      0x5a57
 #define IB200_PRODUCT_ID       0x4210   /* ISDB-T DTV UB-10 */
+#define IB200_MAX_DEVICES      16       /* opened by --all-devices */
 #define IB200_CONFIG_ENDPOINT  0x82
-#define DEFAULT_RDIVIDER 0x70     /* default PLL reference divider */
 #define DEFAULT_NDIVIDER 0x6f8    /* default PLL integer divider */
-#define VCO_CRYSTAL_FREQ 32 /* The oscillator crystal used for driving
-                               the PLL reference frequency operates at 32MHz */
 
 /**
  * The following addresses are used when communicating with the USB device:
@@ -77,17 +88,281 @@ struct user_options {
 	char *writeto;
 	int run_test;
 	bool quiet;
+	bool burst;
+	char *trace;
+	enum ib200_trace_format trace_format;
+	char *sequence;
+	bool fast_sequence;
+	int status_ttl;          /* in msecs */
+	bool status_ttl_set;
+	int firmware_window;     /* 0 for the default */
+	char *firmware;
+	bool force_firmware;
+	bool firmware_marker;
+	bool cold_init;
+	char *startup_report;
+	bool all_devices;
+	int channel;
+	char *channels;
+	bool wait_lock;
+	bool wait_sync;
+	char *profile;
+	bool calibrate;
+};
+
+#define IB200_CMD_SIZE         13      /* size of a regular vendor command */
+#define IB200_CMD_MAX_SIZE     64      /* largest vendor request ever sent to EP0 */
+#define IB200_CMD_WINDOW       4       /* default number of vendor requests in flight */
+#define IB200_CMD_MAX_WINDOW   16
+#define IB200_FW_WINDOW        IB200_CMD_MAX_WINDOW  /* firmware chunks in flight during the upload */
+#define IB200_FW_MAX_SIZE      4096    /* largest firmware blob accepted */
+#define IB200_FW_MARKER_REG    0xfc    /* with --firmware-marker, SMI registers 0xfc-0xff hold the checksum of the firmware uploaded */
+#define IB200_CMD_TIMEOUT      1000    /* in msecs */
+#define IB200_CMD_DELAY        10000   /* settle time of commands missing from delays.h, in usecs */
+#define IB200_CMD_DELAY_AUTO   ((unsigned int) -1) /* look the settle time up in delays.h */
+#define IB200_BURST_MAX        8       /* registers written by a single I2C burst command */
+#define IB200_REOPEN_TRIES     20      /* attempts to find the device again after it re-enumerated */
+#define IB200_REOPEN_INTERVAL  100000  /* in usecs */
+#define IB200_STATUS_TTL       100000  /* how long a sample of the MAX2163 status stays fresh, in usecs */
+#define IB200_I2C_READ_VALUE   6       /* offset of the register value in an I2C read response */
+#define IB200_LOCK_POLL_MIN    250     /* first PLL lock poll interval, doubled on every miss, in usecs */
+#define IB200_LOCK_POLL_MAX    8000    /* in usecs */
+#define IB200_LOCK_TIMEOUT     1000000 /* in usecs */
+#define IB200_LOCK_BYPASS_TIMEOUT 20000 /* with the VCO autoselect bypassed, before searching after all, in usecs */
+#define IB200_CALIBRATION_RUNS 3       /* tunes per band and PLL setting */
+#define IB200_CALIBRATION_SAMPLES 8    /* status reads after lock, checking that it holds */
+#define IB200_CALIBRATION_INTERVAL 1000 /* between those reads, in usecs */
+#define IB200_PROGRESS_REG     0x32    /* 0b ee e0 01 register that counts up for ~400 msecs after a tune */
+#define IB200_PROGRESS_DONE    0x0a
+#define IB200_SYNC_POLL_MAX    100000  /* the captures poll IB200_PROGRESS_REG 100 msecs apart, in usecs */
+#define IB200_SYNC_TIMEOUT     2000000 /* in usecs */
+
+/* The burst layout is a guess: no capture shows byte 4 of an I2C write other than 01 */
+enum ib200_burst_support {
+	IB200_BURST_UNKNOWN,      /* --burst given, not probed yet: the next burst write doubles as a probe */
+	IB200_BURST_SUPPORTED,
+	IB200_BURST_UNSUPPORTED,
+};
+
+/**
+ * Priority classes of the users of the control pipe. When the pipe is released,
+ * the waiting thread with the most urgent class gets it next.
+ */
+enum ib200_prio {
+	IB200_PRIO_TUNE,       /* device initialization and tuning */
+	IB200_PRIO_STREAM,     /* stream start/stop: 0b 00 20 82 01 30 80 ... */
+	IB200_PRIO_POLL,       /* signal and status polling */
+	IB200_PRIO_LED,
+	IB200_PRIO_COUNT,
+};
+
+/**
+ * Recursive lock over the control pipe, granted by priority class. It
+ * serializes request/response transactions on EP0 and keeps per-class
+ * counters of how long callers waited for it.
+ */
+struct ib200_sched {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t owner;
+	int depth;                             /* 0 when nobody holds the pipe */
+	int waiting[IB200_PRIO_COUNT];
+	unsigned long grants[IB200_PRIO_COUNT];
+	uint64_t wait_time[IB200_PRIO_COUNT];  /* in usecs */
+	uint64_t max_wait[IB200_PRIO_COUNT];   /* in usecs */
+};
+
+struct ib200_handle;
+
+/**
+ * Completion callback of a queued vendor request.
+ * @param status 0 on success or a negative LIBUSB_ERROR code
+ * @param data data stage of the request (the response, for IN requests)
+ * @param length number of bytes actually transferred
+ */
+typedef void (*ib200_cmd_callback)(struct ib200_handle *handle, int status,
+	unsigned char *data, int length, void *user_data);
+
+struct ib200_cmd {
+	struct ib200_handle *handle;
+	struct libusb_transfer *transfer;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + IB200_CMD_MAX_SIZE];
+	unsigned int delay;
+	ib200_cmd_callback callback;
+	void *user_data;
+	uint64_t submitted;  /* in usecs */
+	bool busy;
+};
+
+struct ib200_cmd_queue {
+	pthread_mutex_t mutex;  /* protects the fields below against completion callbacks */
+	struct ib200_cmd cmds[IB200_CMD_MAX_WINDOW];
+	int window;           /* maximum number of requests in flight */
+	int in_flight;
+	int delayed;          /* requests in flight that carry a settle time */
+	uint64_t not_before;  /* earliest time (usecs) the next request may be submitted */
+	int error;            /* first error seen since the last fence */
+	int completed;        /* a request completed since ib200_cmd_must_wait() last said to wait */
+};
+
+/**
+ * In-memory mirror of the MAX2163 register file. Setters update val[] and mark
+ * the registers that differ from what the device holds as dirty; a commit then
+ * flushes only those.
+ */
+struct max2163_regs {
+	unsigned char val[MAX2163_NUM_REGS];     /* values wanted by the driver */
+	unsigned char device[MAX2163_NUM_REGS];  /* values last written to the device */
+	uint32_t loaded;                         /* registers whose device[] value is known */
+	uint32_t dirty;                          /* registers to be written on the next commit */
+};
+
+/**
+ * Register banks of the SMI-2020CBE cached by the driver. Writes are sent as
+ * 0b 00 00 82 01 <bank> <reg> <val> ...; the LED commands use 0x00 as wValue
+ * instead of 0x0b.
+ */
+enum ib200_smi_bank {
+	IB200_SMI_BANK_CONFIG,  /* bank 0x00: LED (0x34, 0x35) and configuration (0x3a, 0x3b) */
+	IB200_SMI_BANK_EP82,    /* bank 0x15: registers 0x80-0xff, see ib200_init_ep82() */
+	IB200_SMI_BANK_COUNT,
+};
+
+#define IB200_SMI_NUM_REGS     256
+
+/**
+ * Write-through cache of the SMI-2020CBE registers that only the driver
+ * changes. Writing the value such a register already holds is suppressed, and
+ * reading it is answered from val[] once known.
+ */
+struct ib200_smi_regs {
+	unsigned char val[IB200_SMI_BANK_COUNT][IB200_SMI_NUM_REGS];
+	bool known[IB200_SMI_BANK_COUNT][IB200_SMI_NUM_REGS];
+	unsigned long suppressed;    /* redundant writes not sent */
+	unsigned long local_reads;   /* reads answered from the cache */
+};
+
+/* Decoded MAX2163 STATUS_REG and VAS_STATUS_REG */
+struct max2163_status {
+	uint64_t sampled;         /* when the registers were read, in usecs */
+	unsigned char status;     /* raw STATUS_REG */
+	unsigned char vas_status; /* raw VAS_STATUS_REG */
+	bool pwr_cycle;
+	int charge_pump;          /* CHARGE_PUMP_SETTING */
+	int vtune_adc;            /* VTUNE_ADC_CONVERSION: PLL lock info */
+	bool vase;
+	bool vasa;
+	int vco_subband;
+	int vco_autoselect;
+};
+
+/**
+ * Last sample of the MAX2163 status registers, shared by every consumer. The
+ * registers are read again only once the sample is older than ttl.
+ */
+struct ib200_status_cache {
+	pthread_mutex_t mutex;
+	struct max2163_status status;
+	bool valid;
+	uint64_t ttl;             /* in usecs */
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/**
+ * Firmware blob, as extracted from the Windows driver by firmware-cutter.py.
+ * It is uploaded two bytes at a time.
+ */
+struct ib200_firmware {
+	const unsigned char *data;
+	size_t size;
+	uint32_t checksum;       /* CRC-32 of data */
+	void *map;               /* mapping of the file, or NULL for the built-in blob */
+	size_t map_size;
+};
+
+/**
+ * Steps of the bring-up that the device went through, replayed after a USB
+ * reset. The MAX2163 image is kept in struct max2163_regs.
+ */
+struct ib200_state {
+	bool configured;         /* configuration set and interface claimed */
+	bool firmware_loaded;
+	uint32_t firmware_checksum;  /* checksum of the last firmware uploaded */
+	int alt_setting;         /* -1 while not selected */
+	bool ep82_ready;
+};
+
+/* Phases of the bring-up timed by struct ib200_startup */
+enum ib200_phase {
+	IB200_PHASE_OPEN,               /* libusb_init() up to the device being opened */
+	IB200_PHASE_KERNEL_DRIVER,      /* kernel driver check */
+	IB200_PHASE_WARM_PROBE,         /* ib200_warm_start() */
+	IB200_PHASE_SET_CONFIGURATION,
+	IB200_PHASE_CLAIM_INTERFACE,
+	IB200_PHASE_CONFIG_DESCRIPTOR,
+	IB200_PHASE_MAX2163_INIT,
+	IB200_PHASE_FIRMWARE,
+	IB200_PHASE_ALT_SETTING,
+	IB200_PHASE_EP82,
+	IB200_PHASE_TUNE,               /* ib200_set_channel() */
+	IB200_PHASE_FIRST_PACKET,       /* end of tuning up to the first isochronous packet */
+	IB200_PHASE_COUNT,
+};
+
+/* Time spent in each phase of the bring-up, for --startup-report */
+struct ib200_startup {
+	uint64_t start;                 /* when the process started opening the device, in usecs */
+	uint64_t phase[IB200_PHASE_COUNT];  /* in usecs */
+	uint64_t mark;                  /* end of tuning, in usecs */
+	uint64_t total;                 /* up to the first isochronous packet, in usecs */
+	bool warm;                      /* the init sequence was skipped */
+	bool first_packet;
 };
 
 struct ib200_handle {
 	FILE *fp;
 	struct user_options *user_options;
+	struct ib200_firmware *firmware;  /* NULL for the built-in blob */
+	const struct ib200_channels *channels;
+	libusb_context *ctx;
 	libusb_device *dev;
 	libusb_device_handle *devh;
+	uint8_t bus_number;
+	bool dev_ref;            /* dev was looked up again and holds a reference */
 	bool device_closed;
 	int pending_requests;
+	struct ib200_state state;
+	bool failed;             /* a transfer stalled or the device went away */
+	uint64_t failed_at;      /* in usecs */
+	int outages;
+	uint64_t outage_time;    /* total time between failures and their recovery, in usecs */
+	uint64_t max_outage;     /* in usecs */
+	struct ib200_sched sched;
+	struct ib200_cmd_queue cmdq;
+	struct max2163_regs max2163;
+	struct ib200_smi_regs smi;
+	struct ib200_status_cache status;
+	enum ib200_burst_support i2c_burst;
+	struct ib200_trace trace;
+	struct ib200_latency latency;
+	struct ib200_startup startup;
+	uint64_t lock_time;      /* from the last tune to PLL lock, with --wait-lock, in usecs */
+	struct ib200_profile profile;
 };
 
+/* An isochronous transfer in flight */
+struct ib200_iso {
+	struct ib200_handle *handle;
+	uint64_t submitted;  /* in usecs */
+};
+
+/* Set by SIGUSR1: dump the trace ring at the next opportunity */
+static volatile sig_atomic_t ib200_trace_requested;
+
+/* Set by SIGUSR2: print the latency histograms at the next opportunity */
+static volatile sig_atomic_t ib200_latency_requested;
+
 const char *
 ib200_error(int libusb_error)
 {
@@ -111,89 +386,815 @@ ib200_error(int libusb_error)
 	}
 }
 
-struct ib200_handle *
-ib200_open_device(libusb_device **devlist, size_t n)
+/**
+ * Translate a LIBUSB_TRANSFER status into the LIBUSB_ERROR code that the
+ * synchronous API would have returned for the same condition.
+ */
+static int
+ib200_transfer_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Monotonic clock, in usecs */
+static uint64_t
+ib200_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char *ib200_phase_names[IB200_PHASE_COUNT] = {
+	"open", "kernel_driver", "warm_probe", "set_configuration", "claim_interface",
+	"config_descriptor", "max2163_init", "firmware", "alt_setting", "ep82",
+	"tune", "first_packet"
+};
+
+/**
+ * Account the time elapsed since start to a phase of the bring-up.
+ * @return the current time, to start timing the next phase.
+ */
+static uint64_t
+ib200_phase_done(struct ib200_handle *handle, enum ib200_phase phase, uint64_t start)
+{
+	uint64_t now = ib200_now();
+
+	handle->startup.phase[phase] += now - start;
+	return now;
+}
+
+/**
+ * Write the time spent in each phase of the bring-up as a JSON object.
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_startup_report(struct ib200_handle *handle, FILE *fp)
+{
+	struct ib200_startup *startup = &handle->startup;
+	int i;
+
+	fprintf(fp, "{\"start\": \"%s\", \"first_packet\": %s, \"phases_us\": {",
+		startup->warm ? "warm" : "cold", startup->first_packet ? "true" : "false");
+	for (i=0; i<IB200_PHASE_COUNT; ++i)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", ib200_phase_names[i],
+			(unsigned long long) startup->phase[i]);
+	fprintf(fp, "}, \"total_us\": %llu}\n", (unsigned long long) startup->total);
+	return ferror(fp) ? -EIO : 0;
+}
+
+/**
+ * Look up the settle time of a command in the table extracted from the UsbSnoop logs.
+ * @param cmd command sent (OUT) or response received (IN)
+ * @param in true if cmd is the response of an IN request
+ * @return the settle time in usecs.
+ */
+static unsigned int
+ib200_cmd_delay(unsigned char *cmd, bool in)
+{
+	int i;
+
+	for (i=0; i<sizeof(ib200_delays)/sizeof(ib200_delays[0]); ++i)
+		if (ib200_delays[i].in == in && memcmp(ib200_delays[i].prefix, cmd, 4) == 0)
+			return ib200_delays[i].delay;
+	return IB200_CMD_DELAY;
+}
+
+/* Do not submit the next request before delay usecs have elapsed */
+static void
+ib200_cmd_settle(struct ib200_handle *handle, unsigned int delay)
+{
+	uint64_t not_before = ib200_now() + delay;
+
+	pthread_mutex_lock(&handle->cmdq.mutex);
+	if (not_before > handle->cmdq.not_before)
+		handle->cmdq.not_before = not_before;
+	pthread_mutex_unlock(&handle->cmdq.mutex);
+}
+
+static const char *ib200_prio_names[IB200_PRIO_COUNT] = {
+	"tune", "stream", "poll", "LED"
+};
+
+/**
+ * Classify a vendor command by its contents.
+ * @param cmd command to be sent
+ * @param prio class to use when the command is not a stream start/stop
+ * @return the priority class of the command.
+ */
+static enum ib200_prio
+ib200_cmd_prio(unsigned char *cmd, uint16_t size, enum ib200_prio prio)
+{
+	if (size >= 7 && ! memcmp(cmd, "\x0b\x00\x20\x82\x01\x30\x80", 7))
+		return IB200_PRIO_STREAM;
+	return prio;
+}
+
+/**
+ * Take the control pipe. Recursive: a thread that already holds the pipe
+ * gets it right away, whatever the class.
+ * @param prio priority class of the caller
+ */
+void
+ib200_lock(struct ib200_handle *handle, enum ib200_prio prio)
+{
+	struct ib200_sched *sched = &handle->sched;
+	uint64_t start, waited;
+	int i;
+
+	pthread_mutex_lock(&sched->mutex);
+	if (sched->depth && pthread_equal(sched->owner, pthread_self())) {
+		sched->depth++;
+		pthread_mutex_unlock(&sched->mutex);
+		return;
+	}
+
+	start = ib200_now();
+	sched->waiting[prio]++;
+	while (true) {
+		if (sched->depth == 0) {
+			for (i=0; i<prio; ++i)
+				if (sched->waiting[i])
+					break;
+			if (i == prio)
+				break;
+		}
+		pthread_cond_wait(&sched->cond, &sched->mutex);
+	}
+	sched->waiting[prio]--;
+	sched->owner = pthread_self();
+	sched->depth = 1;
+
+	waited = ib200_now() - start;
+	sched->grants[prio]++;
+	sched->wait_time[prio] += waited;
+	if (waited > sched->max_wait[prio])
+		sched->max_wait[prio] = waited;
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+/**
+ * Release the control pipe taken with ib200_lock().
+ */
+void
+ib200_unlock(struct ib200_handle *handle)
+{
+	struct ib200_sched *sched = &handle->sched;
+
+	pthread_mutex_lock(&sched->mutex);
+	if (--sched->depth == 0)
+		pthread_cond_broadcast(&sched->cond);
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+/**
+ * Print how long each priority class waited for the control pipe.
+ */
+void
+ib200_sched_stats(struct ib200_handle *handle)
+{
+	struct ib200_sched *sched = &handle->sched;
+	int i;
+
+	pthread_mutex_lock(&sched->mutex);
+	for (i=0; i<IB200_PRIO_COUNT; ++i) {
+		if (! sched->grants[i])
+			continue;
+		debug_printf("%-6s: %lu grants, waited %llu usecs in total, %llu usecs at most",
+			ib200_prio_names[i], sched->grants[i],
+			(unsigned long long) sched->wait_time[i],
+			(unsigned long long) sched->max_wait[i]);
+	}
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+/**
+ * Asynchronous command engine.
+ *
+ * Every vendor request sent to EP0 goes through a small set of preallocated
+ * control transfers. Up to cmdq.window requests are kept in flight at once;
+ * since they all share the default pipe, the host controller executes and
+ * completes them in submission order. Callers queue whole register programs
+ * with ib200_cmd_submit() and wait for them with ib200_cmd_fence(), which
+ * also reports the first error seen since the previous fence.
+ *
+ * A request may carry a settle time (delay, in usecs). The next request is
+ * only submitted once the delayed one has completed and its settle time has
+ * elapsed, so the caller is never blocked right after queueing it.
+ *
+ * Completion callbacks run from within libusb's event handler and therefore
+ * must not queue new requests themselves.
+ *
+ * Several threads may share a handle. Each request is queued atomically, and
+ * sequences that must not be interleaved with other threads' requests (such as
+ * an OUT request followed by the IN transfer that reads its response) are run
+ * with the control pipe held; see ib200_lock() and ib200_transact(). Requests
+ * queued without taking the pipe first run in the tune/init class.
+ */
+static int
+ib200_cmd_init(struct ib200_handle *handle)
+{
+	struct ib200_cmd_queue *cmdq = &handle->cmdq;
+	int i;
+
+	memset(&handle->sched, 0, sizeof(handle->sched));
+	pthread_mutex_init(&handle->sched.mutex, NULL);
+	pthread_cond_init(&handle->sched.cond, NULL);
+
+	memset(cmdq, 0, sizeof(*cmdq));
+	pthread_mutex_init(&cmdq->mutex, NULL);
+	cmdq->window = IB200_CMD_WINDOW;
+	for (i=0; i<IB200_CMD_MAX_WINDOW; ++i) {
+		cmdq->cmds[i].handle = handle;
+		cmdq->cmds[i].transfer = libusb_alloc_transfer(0);
+		if (! cmdq->cmds[i].transfer) {
+			perror("libusb_alloc_transfer");
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void
+ib200_cmd_destroy(struct ib200_handle *handle)
+{
+	struct ib200_cmd_queue *cmdq = &handle->cmdq;
+	int i;
+
+	for (i=0; i<IB200_CMD_MAX_WINDOW; ++i)
+		if (cmdq->cmds[i].transfer)
+			libusb_free_transfer(cmdq->cmds[i].transfer);
+	pthread_mutex_destroy(&cmdq->mutex);
+	pthread_cond_destroy(&handle->sched.cond);
+	pthread_mutex_destroy(&handle->sched.mutex);
+}
+
+/* Flag the device for recovery. Called from completion callbacks. */
+static void
+ib200_mark_failed(struct ib200_handle *handle, int status)
+{
+	if (status != LIBUSB_ERROR_PIPE && status != LIBUSB_ERROR_NO_DEVICE)
+		return;
+	if (! handle->failed) {
+		handle->failed_at = ib200_now();
+		handle->failed = true;
+	}
+}
+
+static void
+ib200_cmd_complete(struct libusb_transfer *transfer)
+{
+	struct ib200_cmd *cmd = (struct ib200_cmd *) transfer->user_data;
+	struct ib200_handle *handle = cmd->handle;
+	struct ib200_cmd_queue *cmdq = &handle->cmdq;
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+	unsigned char *data = libusb_control_transfer_get_data(transfer);
+	int status = ib200_transfer_status(transfer->status);
+	bool in = setup->bmRequestType & LIBUSB_ENDPOINT_IN;
+	int length = in ? transfer->actual_length : libusb_le16_to_cpu(setup->wLength);
+	uint64_t now = ib200_now();
+
+	ib200_trace_record(&handle->trace, in ? IB200_TRACE_CTRL_IN : IB200_TRACE_CTRL_OUT,
+		setup->bmRequestType, libusb_le16_to_cpu(setup->wValue),
+		data, length, status, cmd->submitted, now);
+	if (status == 0)
+		ib200_latency_record(&handle->latency, data, length, in, now - cmd->submitted);
+	IB200_PROBE5(cmd__complete, data,
+		length >= 4 ? (data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]) : 0,
+		status, length, now - cmd->submitted);
+
+	if (status < 0) {
+		debug_printf("control transfer failed: %s", ib200_error(transfer->status));
+		ib200_mark_failed(handle, status);
+	}
+
+	if (cmd->delay)
+		ib200_cmd_settle(handle, cmd->delay);
+
+	if (cmd->callback)
+		cmd->callback(handle, status, libusb_control_transfer_get_data(transfer),
+			transfer->actual_length, cmd->user_data);
+
+	pthread_mutex_lock(&cmdq->mutex);
+	if (status < 0 && cmdq->error == 0)
+		cmdq->error = status;
+	if (cmd->delay)
+		cmdq->delayed--;
+	cmd->busy = false;
+	cmdq->in_flight--;
+	cmdq->completed = 1;
+	pthread_mutex_unlock(&cmdq->mutex);
+}
+
+/* Whether a new request has to wait for the in-flight window or for a settle time */
+static bool
+ib200_cmd_must_wait(struct ib200_cmd_queue *cmdq, bool fence)
+{
+	bool ret;
+
+	pthread_mutex_lock(&cmdq->mutex);
+	if (fence)
+		ret = cmdq->in_flight > 0;
+	else
+		ret = cmdq->delayed > 0 || cmdq->in_flight >= cmdq->window;
+	if (ret)
+		cmdq->completed = 0;
+	pthread_mutex_unlock(&cmdq->mutex);
+	return ret;
+}
+
+static void
+ib200_signal(int signum)
+{
+	if (signum == SIGUSR1)
+		ib200_trace_requested = 1;
+	else if (signum == SIGUSR2)
+		ib200_latency_requested = 1;
+}
+
+/**
+ * Write the trace ring to the file given with --trace, or to stderr.
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_trace_save(struct ib200_handle *handle)
+{
+	struct user_options *user_options = handle->user_options;
+	enum ib200_trace_format format = IB200_TRACE_TEXT;
+	FILE *fp = stderr;
+	int count;
+
+	if (user_options && user_options->trace) {
+		format = user_options->trace_format;
+		fp = fopen(user_options->trace, "w");
+		if (! fp) {
+			perror(user_options->trace);
+			return -errno;
+		}
+	}
+	count = ib200_trace_dump(&handle->trace, fp, format);
+	if (fp != stderr) {
+		fclose(fp);
+		debug_printf("saved %d trace records to %s", count, user_options->trace);
+	}
+	return 0;
+}
+
+/**
+ * Query the control transfer latency histograms.
+ * @param space address space
+ * @param in whether to look at IN responses rather than OUT commands
+ * @param percentile between 0 and 100
+ * @return the latency in usecs, or 0 if no such transfer completed yet.
+ */
+uint64_t
+ib200_latency_percentile(struct ib200_handle *handle, enum ib200_space space, bool in, double percentile)
+{
+	return ib200_histogram_percentile(&handle->latency.hist[space][in], percentile);
+}
+
+/* Honour a pending SIGUSR1 or SIGUSR2. Called from the driver's wait loops. */
+static void
+ib200_poll_signals(struct ib200_handle *handle)
+{
+	if (ib200_trace_requested) {
+		ib200_trace_requested = 0;
+		ib200_trace_save(handle);
+	}
+	if (ib200_latency_requested) {
+		ib200_latency_requested = 0;
+		ib200_latency_print(&handle->latency, stderr);
+	}
+}
+
+/**
+ * Handle libusb events for up to 100 msecs.
+ * @param completed if not NULL, return as soon as *completed is set. Handles
+ * sharing the libusb context complete each other's transfers, so the
+ * completion waited for may be handled by another thread.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_cmd_handle_events(struct ib200_handle *handle, int *completed)
+{
+	struct timeval tv = { 0, 100000 };
+	int ret;
+
+	ib200_poll_signals(handle);
+	ret = libusb_handle_events_timeout_completed(handle->ctx, &tv, completed);
+	if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+		debug_printf("libusb_handle_events_timeout: failed with error %d", ret);
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * Queue a vendor request on EP0.
+ * @param handle device handle
+ * @param bmRequestType LIBUSB_ENDPOINT_IN or LIBUSB_ENDPOINT_OUT, plus type and recipient bits
+ * @param wValue wValue, as specified by the USB Specification 2.0
+ * @param data payload of OUT requests; ignored for IN requests
+ * @param size length of the data stage
+ * @param delay settle time to honour before the next request, in usecs
+ * @param callback function to call on completion, or NULL
+ * @param user_data argument passed to the callback
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_cmd_submit(struct ib200_handle *handle, uint8_t bmRequestType, uint16_t wValue,
+	unsigned char *data, uint16_t size, unsigned int delay,
+	ib200_cmd_callback callback, void *user_data)
+{
+	struct ib200_cmd_queue *cmdq = &handle->cmdq;
+	struct ib200_cmd *cmd = NULL;
+	uint64_t now, not_before;
+	int i, ret = 0;
+
+	if (size > IB200_CMD_MAX_SIZE)
+		return -EINVAL;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+
+	/* Wait for a free slot and for the settle time of earlier requests */
+	while (ib200_cmd_must_wait(cmdq, false)) {
+		ret = ib200_cmd_handle_events(handle, &cmdq->completed);
+		if (ret < 0)
+			goto out_unlock;
+	}
+	pthread_mutex_lock(&cmdq->mutex);
+	not_before = cmdq->not_before;
+	pthread_mutex_unlock(&cmdq->mutex);
+	now = ib200_now();
+	if (not_before > now)
+		usleep(not_before - now);
+
+	pthread_mutex_lock(&cmdq->mutex);
+	for (i=0; i<IB200_CMD_MAX_WINDOW; ++i)
+		if (! cmdq->cmds[i].busy) {
+			cmd = &cmdq->cmds[i];
+			break;
+		}
+	cmd->busy = true;
+	cmdq->in_flight++;
+	if (delay)
+		cmdq->delayed++;
+	pthread_mutex_unlock(&cmdq->mutex);
+
+	libusb_fill_control_setup(cmd->buf, bmRequestType, 1, wValue, 0x00, size);
+	if ((bmRequestType & LIBUSB_ENDPOINT_IN) == 0)
+		memcpy(cmd->buf + LIBUSB_CONTROL_SETUP_SIZE, data, size);
+	libusb_fill_control_transfer(cmd->transfer, handle->devh, cmd->buf,
+		ib200_cmd_complete, cmd, IB200_CMD_TIMEOUT);
+	cmd->delay = delay;
+	cmd->callback = callback;
+	cmd->user_data = user_data;
+	cmd->submitted = ib200_now();
+
+	IB200_PROBE3(cmd__submit, cmd->buf + LIBUSB_CONTROL_SETUP_SIZE, size, bmRequestType);
+	ret = libusb_submit_transfer(cmd->transfer);
+	if (ret < 0) {
+		debug_printf("libusb_submit_transfer: failed with error %d", ret);
+		pthread_mutex_lock(&cmdq->mutex);
+		cmd->busy = false;
+		cmdq->in_flight--;
+		if (delay)
+			cmdq->delayed--;
+		pthread_mutex_unlock(&cmdq->mutex);
+	}
+
+out_unlock:
+	ib200_unlock(handle);
+	return ret;
+}
+
+/**
+ * Wait until every queued vendor request has completed.
+ * @return 0 if all of them succeeded, or the first error seen since the previous fence.
+ */
+int
+ib200_cmd_fence(struct ib200_handle *handle)
+{
+	struct ib200_cmd_queue *cmdq = &handle->cmdq;
+	int ret = 0;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	while (ib200_cmd_must_wait(cmdq, true)) {
+		ret = ib200_cmd_handle_events(handle, &cmdq->completed);
+		if (ret < 0)
+			goto out_unlock;
+	}
+
+	pthread_mutex_lock(&cmdq->mutex);
+	ret = cmdq->error;
+	cmdq->error = 0;
+	pthread_mutex_unlock(&cmdq->mutex);
+
+out_unlock:
+	ib200_unlock(handle);
+	return ret;
+}
+
+/**
+ * Change the number of vendor requests kept in flight.
+ * @param window between 1 and IB200_CMD_MAX_WINDOW
+ * @return the previous window.
+ */
+int
+ib200_cmd_set_window(struct ib200_handle *handle, int window)
+{
+	struct ib200_cmd_queue *cmdq = &handle->cmdq;
+	int old;
+
+	if (window < 1)
+		window = 1;
+	else if (window > IB200_CMD_MAX_WINDOW)
+		window = IB200_CMD_MAX_WINDOW;
+
+	pthread_mutex_lock(&cmdq->mutex);
+	old = cmdq->window;
+	cmdq->window = window;
+	pthread_mutex_unlock(&cmdq->mutex);
+	return old;
+}
+
+/**
+ * Queue a vendor OUT command. The first byte of every command is also sent as wValue.
+ * @param delay settle time in usecs, or IB200_CMD_DELAY_AUTO
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_cmd_write(struct ib200_handle *handle, unsigned char *cmd, uint16_t size, unsigned int delay)
+{
+	uint8_t bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
+	int ret;
+
+	if (delay == IB200_CMD_DELAY_AUTO)
+		delay = ib200_cmd_delay(cmd, false);
+
+	ib200_lock(handle, ib200_cmd_prio(cmd, size, IB200_PRIO_TUNE));
+	ret = ib200_cmd_submit(handle, bmRequestType, cmd[0], cmd, size, delay, NULL, NULL);
+	ib200_unlock(handle);
+	return ret;
+}
+
+struct ib200_cmd_result {
+	unsigned char *buf;
+	int size;
+	int length;
+};
+
+static void
+ib200_cmd_read_complete(struct ib200_handle *handle, int status,
+	unsigned char *data, int length, void *user_data)
+{
+	struct ib200_cmd_result *result = (struct ib200_cmd_result *) user_data;
+
+	if (status < 0)
+		return;
+	result->length = length < result->size ? length : result->size;
+	memcpy(result->buf, data, result->length);
+}
+
+/**
+ * Issue a vendor IN request after all previously queued requests and wait for its response.
+ * @param delay settle time in usecs, or IB200_CMD_DELAY_AUTO to pick it based on the response
+ * @return the number of bytes read on success or a negative value on error.
+ */
+int
+ib200_cmd_read(struct ib200_handle *handle, uint16_t wValue,
+	unsigned char *buf, uint16_t size, unsigned int delay)
+{
+	uint8_t bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
+	struct ib200_cmd_result result = { buf, size, 0 };
+	bool auto_delay = delay == IB200_CMD_DELAY_AUTO;
+	int ret;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	ret = ib200_cmd_submit(handle, bmRequestType, wValue, NULL, size, auto_delay ? 0 : delay,
+		ib200_cmd_read_complete, &result);
+	if (ret == 0)
+		ret = ib200_cmd_fence(handle);
+	ib200_unlock(handle);
+	if (ret < 0)
+		return ret;
+
+	if (auto_delay)
+		ib200_cmd_settle(handle, result.length >= 4 ? ib200_cmd_delay(buf, true) : IB200_CMD_DELAY);
+	return result.length;
+}
+
+/**
+ * Send a vendor command and read the response it triggers, without letting
+ * requests from other threads sharing the handle slip in between.
+ * @param request command to send
+ * @param size size of the command
+ * @param response output buffer
+ * @param response_size size of the output buffer
+ * @return the number of bytes read on success or a negative value on error.
+ */
+int
+ib200_transact(struct ib200_handle *handle, unsigned char *request, uint16_t size,
+	unsigned char *response, uint16_t response_size)
+{
+	int ret;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	ret = ib200_cmd_write(handle, request, size, IB200_CMD_DELAY_AUTO);
+	if (ret == 0)
+		ret = ib200_cmd_read(handle, 0x0b, response, response_size, IB200_CMD_DELAY_AUTO);
+	ib200_unlock(handle);
+	return ret;
+}
+
+static void max2163_load_defaults(struct ib200_handle *handle);
+
+/**
+ * Open a 5a57:4210 device and set up a handle for it.
+ * @return the new handle, or NULL on error.
+ */
+static struct ib200_handle *
+ib200_open_one(libusb_context *ctx, libusb_device *dev)
 {
 	int ret;
-	ssize_t i;
 	struct ib200_handle *handle;
 	libusb_device_handle *devh;
 
+	ret = libusb_open(dev, &devh);
+	if (ret < 0) {
+		debug_printf("libusb_open: failed with error %d", ret);
+		return NULL;
+	}
+	handle = calloc(1, sizeof(struct ib200_handle));
+	if (! handle) {
+		libusb_close(devh);
+		perror("malloc");
+		return NULL;
+	}
+	handle->ctx = ctx;
+	handle->dev = dev;
+	handle->devh = devh;
+	handle->bus_number = libusb_get_bus_number(dev);
+	handle->state.alt_setting = -1;
+	if (ib200_cmd_init(handle) < 0) {
+		ib200_cmd_destroy(handle);
+		libusb_close(devh);
+		free(handle);
+		return NULL;
+	}
+	pthread_mutex_init(&handle->status.mutex, NULL);
+	handle->status.ttl = IB200_STATUS_TTL;
+	handle->i2c_burst = IB200_BURST_UNSUPPORTED;
+	/* Start from the power-up image, but do not write it until asked to */
+	max2163_load_defaults(handle);
+	handle->max2163.dirty = 0;
+	return handle;
+}
+
+/* Whether a device from the list is one of ours */
+static int
+ib200_is_supported(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	int ret;
+
+	ret = libusb_get_device_descriptor(dev, &desc);
+	if (ret < 0) {
+		debug_printf("libusb_get_device_descriptor: failed with error %d", ret);
+		return ret;
+	}
+	return desc.idVendor == ZINWELL_VENDOR_ID && desc.idProduct == IB200_PRODUCT_ID;
+}
+
+struct ib200_handle *
+ib200_open_device(libusb_context *ctx, libusb_device **devlist, size_t n)
+{
+	int ret;
+	ssize_t i;
+
 	debug_printf("<--");
 
 	for (i=0; i<n; ++i) {
-		libusb_device *dev = devlist[i];
-		struct libusb_device_descriptor desc;
-
-		ret = libusb_get_device_descriptor(dev, &desc);
-		if (ret < 0) {
-			debug_printf("libusb_get_device_descriptor: failed with error %d", ret);
+		ret = ib200_is_supported(devlist[i]);
+		if (ret < 0)
 			return NULL;
-		}
-
-		if (desc.idVendor == ZINWELL_VENDOR_ID && desc.idProduct == IB200_PRODUCT_ID) {
-			ret = libusb_open(dev, &devh);
-			if (ret < 0) {
-				debug_printf("libusb_open: failed with error %d", ret);
-				return NULL;
-			}
-			handle = calloc(1, sizeof(struct ib200_handle));
-			if (! handle) {
-				libusb_close(devh);
-				perror("malloc");
-				return NULL;
-			}
-			handle->dev = dev;
-			handle->devh = devh;
-			return handle;
-		}
+		if (ret)
+			return ib200_open_one(ctx, devlist[i]);
 	}
 
 	fprintf(stderr, "Failed to find USB device ID %04x:%04x\n", ZINWELL_VENDOR_ID, IB200_PRODUCT_ID);
 	return NULL;
 }
 
+/**
+ * Open every 5a57:4210 device in the list.
+ * @param handles output array
+ * @param max size of the output array
+ * @return the number of devices opened.
+ */
+int
+ib200_open_devices(libusb_context *ctx, libusb_device **devlist, size_t n,
+	struct ib200_handle **handles, int max)
+{
+	int count = 0;
+	ssize_t i;
+
+	debug_printf("<--");
+
+	for (i=0; i<n && count<max; ++i) {
+		if (ib200_is_supported(devlist[i]) <= 0)
+			continue;
+		handles[count] = ib200_open_one(ctx, devlist[i]);
+		if (handles[count])
+			count++;
+	}
+
+	if (count == 0)
+		fprintf(stderr, "Failed to find USB device ID %04x:%04x\n", ZINWELL_VENDOR_ID, IB200_PRODUCT_ID);
+	return count;
+}
+
 void
 ib200_close_device(struct ib200_handle *handle)
 {
 	debug_printf("<--");
 	if (handle) {
+		ib200_cmd_fence(handle);
+		ib200_sched_stats(handle);
+		if (handle->smi.suppressed || handle->smi.local_reads)
+			debug_printf("SMI register cache: %lu writes suppressed, %lu reads answered locally",
+				handle->smi.suppressed, handle->smi.local_reads);
+		if (handle->status.hits || handle->status.misses)
+			debug_printf("MAX2163 status cache: %lu hits, %lu misses",
+				handle->status.hits, handle->status.misses);
+		ib200_latency_print(&handle->latency, stderr);
+		if (handle->user_options && handle->user_options->trace)
+			ib200_trace_save(handle);
+		if (handle->outages)
+			debug_printf("recovered from %d outages, %llu usecs in total, %llu usecs at most",
+				handle->outages, (unsigned long long) handle->outage_time,
+				(unsigned long long) handle->max_outage);
+		ib200_cmd_destroy(handle);
+		pthread_mutex_destroy(&handle->status.mutex);
 		libusb_close(handle->devh);
+		if (handle->dev_ref)
+			libusb_unref_device(handle->dev);
 		free(handle);
 	}
 }
 
 /**
  * Read data from the I2C bus
- * @param devh LibUSB device handle
+ * @param handle device handle
  * @param buf output buffer
  * @param size buffer size
  * @return the number of bytes read on success or a negative value on error.
  */
 static int
-ib200_i2c_read(libusb_device_handle *devh, 
+ib200_i2c_read(struct ib200_handle *handle, 
 	unsigned char *buf, size_t size)
 {
 	int ret;
-	uint8_t bmRequestType, bRequest;
-	uint16_t wValue = 0x0b;
-	uint16_t wIndex = 0x00;
 
-	bRequest = 1;
-	bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
-	ret = libusb_control_transfer(devh, bmRequestType, bRequest, wValue, wIndex, buf, size, 1000);
+	/* The captures hold no MAX2163 reads to take a settle time from, and a
+	   read has nothing to settle: don't let the IB200_CMD_DELAY default slow
+	   down the PLL lock polls */
+	ret = ib200_cmd_read(handle, 0x0b, buf, size, 0);
 	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
+		debug_printf("ib200_cmd_read: failed with error %d", ret);
 		return ret;
 	}
-	printf("USBIN <<< ????  ib200_i2c_read\n");
-	usleep(10000);
-	return 0;
+	return ret;
+}
+
+/* Drop the status sample, e.g. because the registers it depends on changed */
+static void
+ib200_status_invalidate(struct ib200_handle *handle)
+{
+	pthread_mutex_lock(&handle->status.mutex);
+	handle->status.valid = false;
+	pthread_mutex_unlock(&handle->status.mutex);
 }
 
 /**
- * Write data to a register in the I2C bus
- * @param devh LibUSB device handle
+ * Queue a write to a register in the I2C bus
+ * @param handle device handle
  * @param addr address to write to. The MSB is sent as 2nd argument of the command and the LSB as 3rd.
  * @param reg I2C register to write to
  * @param val value to write to the I2C register
@@ -201,14 +1202,12 @@ ib200_i2c_read(libusb_device_handle *devh,
  * @return 0 on success or a negative value on error.
  */
 static int
-ib200_i2c_write(libusb_device_handle *devh,
+ib200_i2c_write(struct ib200_handle *handle,
 	        uint16_t addr, unsigned char reg,
                 unsigned char val, unsigned char last, unsigned char reg_offset)
 {
 	int ret;
-	uint8_t bmRequestType, bRequest;
 	uint16_t wValue = 0x0b;
-	uint16_t wIndex = 0x00;
 	unsigned char addr_high = (addr >> 8) & 0xff;
 	unsigned char addr_low = addr & 0xff;
 	unsigned char cmd[13] = { wValue, addr_high, addr_low, 0x01, 0x01, reg, val, 0x00,
@@ -217,31 +1216,75 @@ ib200_i2c_write(libusb_device_handle *devh,
                             ((reg - reg_offset) >> 16) & 0xff,
                             ((reg - reg_offset) >> 24) & 0xff, last };
 
-	bRequest = 1;
-	bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
-	printf("USBOUT >>> %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-	ret = libusb_control_transfer(devh, bmRequestType, bRequest, wValue, wIndex, cmd, sizeof(cmd), 1000);
+	ret = ib200_cmd_write(handle, cmd, sizeof(cmd), IB200_CMD_DELAY_AUTO);
+	IB200_PROBE3(i2c__write, cmd, sizeof(cmd), ret);
+	if (ret < 0) {
+		debug_printf("ib200_cmd_write: failed with error %d", ret);
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * Queue a write to consecutive registers in the I2C bus using a single command.
+ * Byte 4 of the command holds the number of registers; their values follow the
+ * register number, so the command grows by one byte for each extra register.
+ * @param handle device handle
+ * @param addr address to write to. The MSB is sent as 2nd argument of the command and the LSB as 3rd.
+ * @param reg first I2C register to write to
+ * @param vals values to write to the I2C registers
+ * @param count number of registers to write, up to IB200_BURST_MAX
+ * @param last value to write in the last byte of the command
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_i2c_burst_write(struct ib200_handle *handle,
+	        uint16_t addr, unsigned char reg, unsigned char *vals, int count,
+                unsigned char last, unsigned char reg_offset)
+{
+	int ret;
+	unsigned char cmd[IB200_CMD_SIZE + IB200_BURST_MAX - 1];
+	unsigned char *p = cmd;
+
+	if (count < 1 || count > IB200_BURST_MAX)
+		return -EINVAL;
+
+	*p++ = 0x0b;
+	*p++ = (addr >> 8) & 0xff;
+	*p++ = addr & 0xff;
+	*p++ = 0x01;
+	*p++ = count;
+	*p++ = reg;
+	memcpy(p, vals, count);
+	p += count;
+	*p++ = 0x00;
+	*p++ = (reg - reg_offset) & 0xff;
+	*p++ = ((reg - reg_offset) >> 8) & 0xff;
+	*p++ = ((reg - reg_offset) >> 16) & 0xff;
+	*p++ = ((reg - reg_offset) >> 24) & 0xff;
+	*p++ = last;
+
+	ret = ib200_cmd_write(handle, cmd, p - cmd, IB200_CMD_DELAY_AUTO);
+	IB200_PROBE3(i2c__write, cmd, p - cmd, ret);
 	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
+		debug_printf("ib200_cmd_write: failed with error %d", ret);
 		return ret;
 	}
-	usleep(10000);
 	return 0;
 }
 
 /**
- * Write to the unknown 0beec401 address. I'm calling this a "shadow" register, as the last byte written to the I2C
+ * Queue a write to the unknown 0beec401 address. I'm calling this a "shadow" register, as the last byte written to the I2C
  * (which seems to be a random value) gets also written to this "shadow" register at some points.
  * @param reg 4-byte I2C register. MSB is mapped to the 9th byte, LSB to the 12th byte.
  * @param last value to write in the last byte of the command
+ * @param delay settle time to honour before the next request, in usecs
  * @return 0 on success or a negative value on error.
  */
 static int
-ib200_shadow_write(libusb_device_handle *devh, uint32_t reg, unsigned char last)
+ib200_shadow_write(struct ib200_handle *handle, uint32_t reg, unsigned char last, unsigned int delay)
 {
 	int ret;
-	uint16_t wValue, wIndex;
-	uint8_t bRequestType, bRequest;
 	unsigned char cmd[13] = { 
 		0x0b, 0xee, 0xc4, 0x01, 
 		0x01, 0x02, 0x01, 0x00, 
@@ -252,46 +1295,45 @@ ib200_shadow_write(libusb_device_handle *devh, uint32_t reg, unsigned char last)
 		last 
 	};
 	
-	bRequest = 1;
-	wValue = 0x0b;
-	wIndex = 0x00;
-	bRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
-	printf("USBOUT >>> %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-	ret = libusb_control_transfer(devh, bRequestType, bRequest, wValue, wIndex, cmd, sizeof(cmd), 1000);
+	ret = ib200_cmd_write(handle, cmd, sizeof(cmd), delay);
+	IB200_PROBE3(shadow__write, cmd, sizeof(cmd), ret);
 	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
+		debug_printf("ib200_cmd_write: failed with error %d", ret);
 		return ret;
 	}
-	usleep(10000);
 	return 0;
 }
 
+static void
+endpoint_cmd(unsigned char *cmd, unsigned char endpoint, uint16_t addr, uint16_t wValue, unsigned char *data)
+{
+	cmd[0] = wValue;
+	cmd[1] = (addr >> 8) & 0xff;
+	cmd[2] = addr & 0xff;
+	cmd[3] = endpoint;
+	cmd[4] = 0x01;
+	memcpy(&cmd[5], data, 8);
+}
+
 static int
-endpoint_write(libusb_device_handle *devh, unsigned char endpoint, uint16_t addr, uint16_t wValue, uint16_t wIndex, unsigned char *data)
+endpoint_write(struct ib200_handle *handle, unsigned char endpoint, uint16_t addr, uint16_t wValue, uint16_t wIndex, unsigned char *data)
 {
 	int ret;
-	uint8_t bmRequestType, bRequest;
-	unsigned char stub = 0x00;
-	unsigned char addr_high = (addr >> 8) & 0xff;
-	unsigned char addr_low = addr & 0xff;
-	unsigned char cmd[13] = { wValue, addr_high, addr_low, endpoint, 0x01, stub, stub, stub, stub, stub, stub, stub, stub };
+	unsigned char cmd[13];
 
-	memcpy(&cmd[5], data, 8);
-	bRequest = 1;
-	bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
-	printf("USBOUT >>> %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-	ret = libusb_control_transfer(devh, bmRequestType, bRequest, wValue, wIndex, cmd, sizeof(cmd), 1000);
+	endpoint_cmd(cmd, endpoint, addr, wValue, data);
+	ret = ib200_cmd_write(handle, cmd, sizeof(cmd), IB200_CMD_DELAY_AUTO);
+	IB200_PROBE3(endpoint__write, cmd, sizeof(cmd), ret);
 	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
+		debug_printf("ib200_cmd_write: failed with error %d", ret);
 		return ret;
 	}
-	usleep(10000);
 	return 0;
 }
 
 /**
- * Write to the USB configuration endpoint
- * @param devh LibUSB device handle
+ * Queue a write to the USB configuration endpoint
+ * @param handle device handle
  * @param addr address to write to. The MSB is sent as 2nd argument of the command and the LSB as 3rd.
  * @param wValue wValue, as specified by the USB Specification 2.0
  * @param wIndex wIndex, as specified by the USB Specification 2.0
@@ -299,69 +1341,188 @@ endpoint_write(libusb_device_handle *devh, unsigned char endpoint, uint16_t addr
  * @return 0 on success or a negative value on error.
  */
 static int
-ib200_endpoint_write(libusb_device_handle *devh, uint16_t addr, uint16_t wValue, uint16_t wIndex, unsigned char *data)
+ib200_endpoint_write(struct ib200_handle *handle, uint16_t addr, uint16_t wValue, uint16_t wIndex, unsigned char *data)
 {
-	return endpoint_write(devh, IB200_CONFIG_ENDPOINT, addr, wValue, wIndex, data);
+	return endpoint_write(handle, IB200_CONFIG_ENDPOINT, addr, wValue, wIndex, data);
 }
 
 // OUT -> 0b 00 20 82 01 15 80 83 18 01 00 00 74
 // IN  <- 0b 00 00 82 01 15 80 c3 18 01 00 00 74
 int
-read_misterious_registers(libusb_device_handle *devh, unsigned char reg, unsigned char* return_value)
+read_misterious_registers(struct ib200_handle *handle, unsigned char reg, unsigned char* return_value)
 {
-	uint8_t request_type, request;
-	uint16_t value, index, addr;
+	uint16_t addr;
 	int ret;
-	unsigned char data[8], buf[13];
+	unsigned char data[8], cmd[13], buf[13];
 
 	addr = 0x0020;
 	memcpy(data, "\x15\x80\x00\x18\x01\x00\x00\x74", 8);
 
 	data[1]=reg;
-	ret = ib200_endpoint_write(devh, addr, 0x0b, 0x00, data);
-	if (ret < 0){
-		printf("read_misterious_registers: error writing to endpoint\n");
-		return ret;}
-
-	value = 0x0b;
-	index = 0x00;
-	request = 0x01;
-	request_type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
-	ret = libusb_control_transfer(devh, request_type, request, value, index, buf, sizeof(buf), 1000);
+	endpoint_cmd(cmd, IB200_CONFIG_ENDPOINT, addr, 0x0b, data);
+	ret = ib200_transact(handle, cmd, sizeof(cmd), buf, sizeof(buf));
 	if (ret < 0) {
-		debug_printf("read_misterious_registers: libusb_control_transfer: failed with error %d", ret);
+		debug_printf("read_misterious_registers: ib200_transact: failed with error %d", ret);
 		return ret;
 	}
 
 	hexdump(buf, sizeof(buf));
 	*return_value = buf[7];
-	usleep(1000);
 	return 0;
 }
 
-// OUT -> 0b 00 20 82 01 15 80 83 18 01 00 00 74
-// IN  <- 0b 00 00 82 01 15 80 c3 18 01 00 00 74
-int
-write_misterious_registers(libusb_device_handle *devh, unsigned char reg, unsigned char value)
+// OUT -> 0b 00 20 82 01 15 80 83 18 01 00 00 74
+// IN  <- 0b 00 00 82 01 15 80 c3 18 01 00 00 74
+int
+write_misterious_registers(struct ib200_handle *handle, unsigned char reg, unsigned char value)
+{
+	int ret;
+	uint16_t addr = 0x0000;
+
+	unsigned char data[8];
+	memcpy(data, "\x15\x00\x00\x18\x01\x00\x00\x74", 8);
+
+	data[1]=reg;
+	data[2]=value;
+	ret = ib200_endpoint_write(handle, addr, 0x0b, 0x00, data);
+	if (ret < 0){
+		printf("write_misterious_registers: error writing to endpoint\n");
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * SMI-2020CBE registers that hold whatever the driver last wrote to them, and
+ * can therefore be cached. Everything else is always read from the device.
+ * Register 0x80 of bank 0x15 is not one of them: the captures read 0x83 and
+ * 0x03 back before 0xc3 was ever written, so the device changes it by itself.
+ */
+static const bool ib200_smi_static[IB200_SMI_BANK_COUNT][IB200_SMI_NUM_REGS] = {
+	[IB200_SMI_BANK_CONFIG] = { [0x34] = true, [0x35] = true, [0x3a] = true, [0x3b] = true },
+	[IB200_SMI_BANK_EP82]   = {
+		[IB200_FW_MARKER_REG] = true, [IB200_FW_MARKER_REG + 1] = true,
+		[IB200_FW_MARKER_REG + 2] = true, [IB200_FW_MARKER_REG + 3] = true },
+};
+
+/* Cache bank of the SMI-2020CBE bank number sent in a command, or -1 if it is not cached */
+static int
+ib200_smi_bank(unsigned char bank)
+{
+	switch (bank) {
+		case 0x00:
+			return IB200_SMI_BANK_CONFIG;
+		case 0x15:
+			return IB200_SMI_BANK_EP82;
+		default:
+			return -1;
+	}
+}
+
+/* Forget the cached SMI-2020CBE registers, e.g. after the device was reset */
+static void
+ib200_smi_forget(struct ib200_handle *handle)
+{
+	memset(handle->smi.known, 0, sizeof(handle->smi.known));
+}
+
+/**
+ * Check a register write against the cache.
+ * @param data data of the EP 0x82 command: bank, register and value
+ * @return true if the register is known to hold that value already.
+ */
+static bool
+ib200_smi_redundant(struct ib200_handle *handle, const unsigned char *data)
+{
+	struct ib200_smi_regs *smi = &handle->smi;
+	int bank = ib200_smi_bank(data[0]);
+
+	if (bank < 0 || ! smi->known[bank][data[1]] || smi->val[bank][data[1]] != data[2])
+		return false;
+	smi->suppressed++;
+	return true;
+}
+
+/* Record a register write that the device acknowledged */
+static void
+ib200_smi_store(struct ib200_handle *handle, const unsigned char *data)
+{
+	struct ib200_smi_regs *smi = &handle->smi;
+	int bank = ib200_smi_bank(data[0]);
+
+	if (bank < 0 || ! ib200_smi_static[bank][data[1]])
+		return;
+	smi->val[bank][data[1]] = data[2];
+	smi->known[bank][data[1]] = true;
+}
+
+/**
+ * Mark a SMI-2020CBE register unknown after a failed write.
+ * @param data bank and register, as in ib200_smi_store
+ */
+static void
+ib200_smi_unknown(struct ib200_handle *handle, const unsigned char *data)
 {
-	int ret;
-	uint16_t addr = 0x0000;
+	int bank = ib200_smi_bank(data[0]);
 
-	unsigned char data[8];
-	memcpy(data, "\x15\x00\x00\x18\x01\x00\x00\x74", 8);
+	if (bank >= 0)
+		handle->smi.known[bank][data[1]] = false;
+}
 
-	data[1]=reg;
-	data[2]=value;
-	ret = ib200_endpoint_write(devh, addr, 0x0b, 0x00, data);
-	if (ret < 0){
-		printf("write_misterious_registers: error writing to endpoint\n");
-		return ret;
+/**
+ * Write a SMI-2020CBE register through the cache.
+ * @param wValue first byte of the command
+ * @param data 8-byte data of the EP 0x82 command: bank, register, value and trailing bytes
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_smi_write(struct ib200_handle *handle, uint16_t wValue, unsigned char *data)
+{
+	int ret = 0;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	if (! ib200_smi_redundant(handle, data)) {
+		/* Only cache the value once it reached the device, or a failed write would suppress its retries */
+		ret = ib200_endpoint_write(handle, 0x0000, wValue, 0x00, data);
+		if (ret == 0)
+			ret = ib200_cmd_fence(handle);
+		if (ret == 0)
+			ib200_smi_store(handle, data);
+		else
+			ib200_smi_unknown(handle, data);
 	}
-	return 0;
+	ib200_unlock(handle);
+	return ret;
+}
+
+/**
+ * Read a register of the 0x80-0xff space, from the cache if it is known.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_smi_read(struct ib200_handle *handle, unsigned char reg, unsigned char *value)
+{
+	struct ib200_smi_regs *smi = &handle->smi;
+	unsigned char data[3] = { 0x15, reg, 0x00 };
+	int ret = 0;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	if (smi->known[IB200_SMI_BANK_EP82][reg]) {
+		*value = smi->val[IB200_SMI_BANK_EP82][reg];
+		smi->local_reads++;
+	} else {
+		ret = read_misterious_registers(handle, reg, value);
+		if (ret == 0) {
+			data[2] = *value;
+			ib200_smi_store(handle, data);
+		}
+	}
+	ib200_unlock(handle);
+	return ret;
 }
 
 void
-test_misterious_registers(libusb_device_handle *devh)
+test_misterious_registers(struct ib200_handle *handle)
 {
 	int reg, i;
 	unsigned char retval;
@@ -369,11 +1530,11 @@ test_misterious_registers(libusb_device_handle *devh)
 	for (reg=0x80;reg<=0xff;reg++){
 		printf("%x: ", reg);
 		for (i=7;i>=0;i--){
-			write_misterious_registers(devh, reg, 1 << i);
-			read_misterious_registers(devh, reg, &retval);
+			write_misterious_registers(handle, reg, 1 << i);
+			read_misterious_registers(handle, reg, &retval);
 			if (retval & (1 << i)){
-				write_misterious_registers(devh, reg, 0);
-				read_misterious_registers(devh, reg, &retval);
+				write_misterious_registers(handle, reg, 0);
+				read_misterious_registers(handle, reg, &retval);
 				if (retval & (1 << i))
 					printf("1 ");
 				else
@@ -384,6 +1545,9 @@ test_misterious_registers(libusb_device_handle *devh)
 		}
 		printf("\n");
 	}
+
+	/* The probe wrote behind the back of the cache */
+	ib200_smi_forget(handle);
 	return;
 }
 
@@ -395,42 +1559,32 @@ test_misterious_registers(libusb_device_handle *devh)
 // OUT -> 0b ee e0 01 01 32 00 88 04 db 87 8f 00
 // IN  <- 0b ee e0 01 01 32 0a 88 04 db 87 8f 00
 int
-read_misterious_registers_2(libusb_device_handle *devh, unsigned char reg, unsigned char* return_value)
+read_misterious_registers_2(struct ib200_handle *handle, unsigned char reg, unsigned char* return_value)
 {
-	uint8_t request_type, request;
-	uint16_t value, index, addr;
+	uint16_t addr;
 	int ret;
-	unsigned char data[8], buf[13];
+	unsigned char data[8], cmd[13], buf[13];
 
 	addr = 0xeee0;
 	memcpy(data, "\x32\x00\x88\x04\xdb\x87\x8f\x00", 8);
 
 	data[MISTREG2]=reg;
-	ret = endpoint_write(devh, 0x01, addr, 0x0b, 0x00, data);
-	if (ret < 0){
-		printf("read_misterious_registers: error writing to endpoint\n");
-		return ret;}
-
-	value = 0x0b;
-	index = 0x00;
-	request = 0x01;
-	request_type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
-	ret = libusb_control_transfer(devh, request_type, request, value, index, buf, sizeof(buf), 1000);
+	endpoint_cmd(cmd, 0x01, addr, 0x0b, data);
+	ret = ib200_transact(handle, cmd, sizeof(cmd), buf, sizeof(buf));
 	if (ret < 0) {
-		debug_printf("read_misterious_registers: libusb_control_transfer: failed with error %d", ret);
+		debug_printf("read_misterious_registers: ib200_transact: failed with error %d", ret);
 		return ret;
 	}
 
 //	hexdump(buf, sizeof(buf));
 	*return_value = buf[5+MISTVAL2];
-	usleep(1000);
 	return 0;
 }
 
 // OUT -> 0b ee e0 01 01 32 00 88 04 db 87 8f 00
 // IN  <- 0b ee e0 01 01 32 0a 88 04 db 87 8f 00
 int
-write_misterious_registers_2(libusb_device_handle *devh, unsigned char reg, unsigned char value)
+write_misterious_registers_2(struct ib200_handle *handle, unsigned char reg, unsigned char value)
 {
 	int ret;
 	uint16_t addr = 0x0000;
@@ -440,7 +1594,7 @@ write_misterious_registers_2(libusb_device_handle *devh, unsigned char reg, unsi
 
 	data[MISTREG2]=reg;
 	data[MISTVAL2]=value;
-	ret = ib200_endpoint_write(devh, addr, 0x0b, 0x00, data);
+	ret = ib200_endpoint_write(handle, addr, 0x0b, 0x00, data);
 	if (ret < 0){
 		printf("write_misterious_registers: error writing to endpoint\n");
 		return ret;
@@ -449,7 +1603,7 @@ write_misterious_registers_2(libusb_device_handle *devh, unsigned char reg, unsi
 }
 
 void
-test_misterious_registers_2(libusb_device_handle *devh)
+test_misterious_registers_2(struct ib200_handle *handle)
 {
 	int reg, i;
 	unsigned char retval;
@@ -457,11 +1611,11 @@ test_misterious_registers_2(libusb_device_handle *devh)
 	for (reg=0x80;reg<=0xff;reg++){
 		printf("%x: ", reg);
 		for (i=7;i>=0;i--){
-			write_misterious_registers_2(devh, reg, 1 << i);
-			read_misterious_registers_2(devh, reg, &retval);
+			write_misterious_registers_2(handle, reg, 1 << i);
+			read_misterious_registers_2(handle, reg, &retval);
 			if (retval & (1 << i)){
-				write_misterious_registers_2(devh, reg, 0);
-				read_misterious_registers_2(devh, reg, &retval);
+				write_misterious_registers_2(handle, reg, 0);
+				read_misterious_registers_2(handle, reg, &retval);
 				if (retval & (1 << i))
 					printf("1 ");
 				else
@@ -476,17 +1630,27 @@ test_misterious_registers_2(libusb_device_handle *devh)
 }
 
 int
-ib200_setup_LED(libusb_device_handle *devh)
+ib200_setup_LED(struct ib200_handle *handle)
 {
-	unsigned char data[] = {0x00, 0x34, 0x20};
-	return ib200_endpoint_write(devh, 0x0000, 0x00, 0x00, data);
+	unsigned char data[8] = {0x00, 0x34, 0x20};
+	int ret;
+
+	ib200_lock(handle, IB200_PRIO_LED);
+	ret = ib200_smi_write(handle, 0x00, data);
+	ib200_unlock(handle);
+	return ret;
 }
 
 int
-ib200_set_LED(libusb_device_handle *devh, bool state)
+ib200_set_LED(struct ib200_handle *handle, bool state)
 {
-	unsigned char data[] = {0x00, 0x35, state ? 0x20 : 0x00};
-	return ib200_endpoint_write(devh, 0x0000, 0x00, 0x00, data);
+	unsigned char data[8] = {0x00, 0x35, state ? 0x20 : 0x00};
+	int ret;
+
+	ib200_lock(handle, IB200_PRIO_LED);
+	ret = ib200_smi_write(handle, 0x00, data);
+	ib200_unlock(handle);
+	return ret;
 }
 
 int
@@ -494,14 +1658,17 @@ ib200_blink_LED(struct ib200_handle *handle)
 {
 	int ret;
 	bool state = false;
-	libusb_device_handle *devh = handle->devh;
 
-	ret = ib200_setup_LED(devh);
+	ret = ib200_setup_LED(handle);
 	if (ret < 0)
 		return ret;
 
 	while (true){
-		ret = ib200_set_LED(devh, state);
+		ib200_lock(handle, IB200_PRIO_LED);
+		ret = ib200_set_LED(handle, state);
+		if (ret == 0)
+			ret = ib200_cmd_fence(handle);
+		ib200_unlock(handle);
 		if (ret < 0)
 			return ret;
 	
@@ -518,14 +1685,11 @@ ib200_blink_LED(struct ib200_handle *handle)
  * It looks like the commands are 0x34, 0x35, 0x3a and 0x3b.
  */
 int
-ib200_init_configuration_descriptor(libusb_device_handle *devh)
+ib200_init_configuration_descriptor(struct ib200_handle *handle)
 {
 	int ret;
-	unsigned char buf[65535];
+	unsigned char buf[2];
 	unsigned char data[8];
-	uint8_t request_type, request;
-	uint16_t value, index;
-	uint16_t addr = 0x0000;
 
 	/* Get status from the configuration descriptor */
 	/*                                          ------------- request_type
@@ -537,27 +1701,23 @@ ib200_init_configuration_descriptor(libusb_device_handle *devh)
 	 * edbd5e00 2053267881 S Ci:1:017:0 s c0 01 0001 0000 0002 2 <
 	 * edbd5e00 2053268007 C Ci:1:017:0 0 2 = 0103
 	 */
-	request = 1; value = 0x01; index = 0;
-	request_type = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
-	ret = libusb_control_transfer(devh, request_type, request, value, index, buf, 2, 1000);
+	ret = ib200_cmd_read(handle, 0x01, buf, 2, 0);
 	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
+		debug_printf("ib200_cmd_read: failed with error %d", ret);
 		return 1;
 	}
 
-	printf("USBIN <<< ????  1st libusb_control_transfer call at ib200_init_configuration_descriptor\n");
-
 	/* TODO: interpret the 2 bytes returned (0x01 0x03) */
 	hexdump(buf, 0x2);
 
 	/* \x0b\x00\x00\x82\x01\x00\x34\x21\xf0\xbc\x33\x89\x00 */
-	ib200_setup_LED(devh);
+	ib200_setup_LED(handle);
 
 	/* \x0b\x00\x00\x82\x01\x00\x35\x21\xf0\xbc\x33\x89\x00 */
-	ib200_set_LED(devh, true);
+	ib200_set_LED(handle, true);
 	
 	/* \x0b\x00\x00\x82\x01\x00\x35\x01\x00\x00\x00\x00\xea */
-	ib200_set_LED(devh, false);
+	ib200_set_LED(handle, false);
 
 	/* 
 	 * TODO: interpret the commands below.
@@ -565,227 +1725,675 @@ ib200_init_configuration_descriptor(libusb_device_handle *devh)
 	 * 3 bytes are meaningful. The remaning ones looks like garbage.
 	 */
 
-	/* \x0b\x00\x00\x82\x01\x00\x3a\x80\x00\x00\x00\x00\xea */
-	memcpy(data, "\x00\x3a\x80\x00\x00\x00\x00\xea", 8);
-	ret = ib200_endpoint_write(devh, addr, 0x0b, 0x00, data);
-	if (ret < 0)
-		return ret;
+	/* \x0b\x00\x00\x82\x01\x00\x3a\x80\x00\x00\x00\x00\xea */
+	memcpy(data, "\x00\x3a\x80\x00\x00\x00\x00\xea", 8);
+	ret = ib200_smi_write(handle, 0x0b, data);
+	if (ret < 0)
+		return ret;
+
+	/* \x0b\x00\x00\x82\x01\x00\x3b\x00\x00\x00\x00\x00\xea */
+	memcpy(data, "\x00\x3b\x00\x00\x00\x00\x00\xea", 8);
+	ret = ib200_smi_write(handle, 0x0b, data);
+	if (ret < 0)
+		return ret;
+
+	/* XXX: in another log I noticed 0xf9 instead of 0x39 */
+	/* \x0b\xee\xc4\x01\x01\x02\x01\x00\x58\x39\x52\xba\x0d */
+	ret = ib200_shadow_write(handle, 0xba523958, 0x0d, IB200_CMD_DELAY_AUTO);
+	if (ret < 0)
+		return ret;
+
+	return ib200_cmd_fence(handle);
+}
+
+/**
+ * Last byte sent along with each MAX2163 register write. Its meaning is unknown:
+ * the Windows driver sends a different value almost every time. These are the
+ * ones seen in logs/Log/lucasvr-01-hotplug.log.
+ */
+static const unsigned char max2163_magic[MAX2163_NUM_REGS] = {
+	[IF_FILTER_REG]    = 0x33,
+	[VAS_REG]          = 0x6e,
+	[VCO_REG]          = 0xaa,
+	[RF_FILTER_REG]    = 0xe6,
+	[MODE_REG]         = 0x22,
+	[RDIVIDER_MSB_REG] = 0x5d,
+	[RDIVIDER_LSB_REG] = 0x99,
+	[NDIVIDER_MSB_REG] = 0xd5,
+	[NDIVIDER_LSB_REG] = 0x11,
+	[0x11] = 0x4c, [0x12] = 0x88, [0x13] = 0xc4,
+	[0x14] = 0x00, [0x15] = 0x3b, [0x16] = 0x77,
+};
+
+/* Forget what the device holds, so that the next commit rewrites every register set so far */
+static void
+max2163_forget(struct ib200_handle *handle)
+{
+	struct max2163_regs *regs = &handle->max2163;
+
+	regs->dirty |= regs->loaded;
+	regs->loaded = 0;
+}
+
+/**
+ * Update a field of the MAX2163 register mirror.
+ * @param reg register number
+ * @param mask bits of the field within the register
+ * @param value new value of the field, already shifted into place
+ */
+static void
+max2163_set(struct ib200_handle *handle, unsigned char reg, unsigned char mask, unsigned char value)
+{
+	struct max2163_regs *regs = &handle->max2163;
+
+	regs->val[reg] = (regs->val[reg] & ~mask) | (value & mask);
+	if (! (regs->loaded & (1 << reg)) || regs->val[reg] != regs->device[reg])
+		regs->dirty |= 1 << reg;
+	else
+		regs->dirty &= ~(1 << reg);
+}
+
+static void
+max2163_set_rdivider(struct ib200_handle *handle, int r_divider)
+{
+	max2163_set(handle, RDIVIDER_MSB_REG, RDIVIDER_MSB_REG_MASK, PLL_MOST_RDIVIDER(r_divider));
+	max2163_set(handle, RDIVIDER_LSB_REG, RDIVIDER_LSB_MASK, PLL_LEAST_RDIVIDER(r_divider));
+}
+
+static void
+max2163_set_ndivider(struct ib200_handle *handle, int n_divider)
+{
+	max2163_set(handle, NDIVIDER_MSB_REG, 0xff, PLL_MOST_NDIVIDER(n_divider));
+	max2163_set(handle, NDIVIDER_LSB_REG, NDIVIDER_LSB_MASK, PLL_LEAST_NDIVIDER(n_divider));
+}
+
+/**
+ * Queue the I2C writes for a run of consecutive MAX2163 registers, as a single
+ * burst command with --burst. The first burst ever attempted is fenced right
+ * away: if the bridge rejects it, bursts are disabled for good and the run is
+ * written one register at a time. A bridge that takes the burst for a single
+ * write goes unnoticed, as the MAX2163 registers cannot be read back, hence
+ * bursts being opt-in.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+max2163_write_run(struct ib200_handle *handle, int reg, int count, unsigned char reg_offset)
+{
+	struct max2163_regs *regs = &handle->max2163;
+	uint16_t addr = (MAX2163_I2C_WRITE_ADDR << 8) | MAX2163_I2C_WRITE_ADDR;
+	int i, ret;
+
+	if (count > 1 && handle->i2c_burst != IB200_BURST_UNSUPPORTED) {
+		/* Do not blame the probe for errors of earlier requests */
+		if (handle->i2c_burst == IB200_BURST_UNKNOWN) {
+			ret = ib200_cmd_fence(handle);
+			if (ret < 0)
+				return ret;
+		}
+
+		ret = ib200_i2c_burst_write(handle, addr, reg, &regs->val[reg], count,
+			max2163_magic[reg], reg_offset);
+		if (ret < 0 || handle->i2c_burst == IB200_BURST_SUPPORTED)
+			return ret;
+
+		ret = ib200_cmd_fence(handle);
+		if (ret == 0) {
+			handle->i2c_burst = IB200_BURST_SUPPORTED;
+			return 0;
+		}
+		if (ret == LIBUSB_ERROR_NO_DEVICE)
+			return ret;
+		debug_printf("I2C burst writes are not supported by the bridge (error %d)", ret);
+		handle->i2c_burst = IB200_BURST_UNSUPPORTED;
+		/* The stall was the answer to the probe, not a reason to reset the device */
+		handle->failed = false;
+	}
+
+	for (i=reg; i<reg+count; ++i) {
+		ret = ib200_i2c_write(handle, addr, i, regs->val[i], max2163_magic[i], reg_offset);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * Write the dirty registers of the mirror to the MAX2163.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+max2163_commit(struct ib200_handle *handle)
+{
+	struct max2163_regs *regs = &handle->max2163;
+	uint32_t dirty = regs->dirty;
+	unsigned int delay = IB200_CMD_DELAY_AUTO;
+	int reg, count, ret = 0;
+
+	/* The settle time logged after each shadow write is what the PLL takes to lock
+	   at worst. With --wait-lock, ib200_wait_for_lock() finds out when it actually did */
+	if (handle->user_options && handle->user_options->wait_lock)
+		delay = 0;
+
+	for (reg=0; reg<MAX2163_NUM_REGS && ret == 0; reg+=count) {
+		/* The non-documented registers from 0x11 onwards are numbered from 0 in the command */
+		unsigned char reg_offset = reg >= 0x11 ? 0x11 : 0x00;
+		int i;
+
+		count = 1;
+		if (! (dirty & (1 << reg)))
+			continue;
+
+		while (count < IB200_BURST_MAX && reg + count < MAX2163_NUM_REGS &&
+				reg + count != 0x11 && (dirty & (1 << (reg + count))))
+			count++;
+
+		ret = max2163_write_run(handle, reg, count, reg_offset);
+
+		/* Based on log analysis:
+		   For some unknown reason, the last non-documented register lacks a corresponding shadow write... */
+		for (i=reg; i<reg+count && ret == 0; ++i)
+			if (i < 0x16)
+				ret = ib200_shadow_write(handle, i - reg_offset, max2163_magic[i], delay);
+	}
+	if (ret == 0)
+		ret = ib200_cmd_fence(handle);
+	if (ret < 0) {
+		debug_printf("Failed to commit the MAX2163 registers");
+		regs->loaded &= ~dirty;
+		return ret;
+	}
+
+	memcpy(regs->device, regs->val, sizeof(regs->device));
+	regs->loaded |= dirty;
+	regs->dirty = 0;
+
+	/* A new PLL setting invalidates the lock state sampled so far */
+	if (dirty)
+		ib200_status_invalidate(handle);
+	return 0;
+}
+
+/**
+ * Load a reasonable MAX2163 configuration into the register mirror.
+ */
+static void
+max2163_load_defaults(struct ib200_handle *handle)
+{
+	int reg;
+
+	/* Initialize the IF Filter Register */
+//OBS: Datasheet suggests using BIAS_CURRENT_01 upon power-up
+//     but the observed log uses BIAS_CURRENT_11
+	max2163_set(handle, IF_FILTER_REG, 0xff,
+			BANDWIDTH_13MHZ | BIAS_CURRENT_11 | 
+			FLTS_INTERNAL | CENTER_FREQUENCY_1_00);
+
+	/* Initialize the VAS Register */
+	max2163_set(handle, VAS_REG, 0xff,
+                          START_AT_CURR_LOADED_REGS | ENABLE_VCO_AUTOSELECT |
+                          CPS_AUTOMATIC | DISABLE_ADC_LATCH | ENABLE_ADC_READ | AUTOSELECT_45056_WAIT_TIME);
+
+	/* Initialize the VCO Register */
+	max2163_set(handle, VCO_REG, 0xff,
+			              VCO_1 | SUB_BAND_4 | VCOB_LOW_POWER);
+
+	/* Initialize the PDET/RF-FILT Register */
+	max2163_set(handle, RF_FILTER_REG, 0xff,
+			              UHF_RANGE_710_806MHZ | PWRDET_BUF_ON_GC1);
+
+	/* Initialize the MODE Register */
+	max2163_set(handle, MODE_REG, 0xff,
+                          HIGH_SIDE_INJECTION | ENABLE_RF_FILTER | ENABLE_3RD_STAGE_RFVGA);
+
+	/* Initialize the R-Divider MSB and LSB/CP Registers */
+	max2163_set(handle, RDIVIDER_LSB_REG, 0xff,
+                          RFDA_37DB | ENABLE_RF_DETECTOR | CHARGE_PUMP_1_5MA);
+	max2163_set_rdivider(handle, /* TODO:0x38 */ DEFAULT_RDIVIDER);
+
+	/* Initialize the N-Divider MSB and LSB/LIN Registers */
+	max2163_set(handle, NDIVIDER_LSB_REG, 0xff,
+			STBY_NORMAL | RFVGA_NORMAL | MIX_NORMAL);
+	max2163_set_ndivider(handle, DEFAULT_NDIVIDER);
+
+	/* Initialize non-documented registers */
+	for (reg=0x11; reg<=0x16; ++reg)
+		max2163_set(handle, reg, 0xff, 0x00);
+}
+
+/* Lay the register image of a channel over the MAX2163 register mirror. Nothing is written to the device. */
+static void
+max2163_set_channel(struct ib200_handle *handle, const struct ib200_channel *channel)
+{
+	int reg;
+
+	for (reg=0; reg<MAX2163_NUM_REGS; ++reg)
+		if (channel->regs & (1 << reg))
+			max2163_set(handle, reg, channel->mask[reg], channel->val[reg]);
+}
+
+/**
+ * Start the VCO autoselect from the VCO and sub-band a channel locked with
+ * before, if any, or from the power-up default otherwise. With --wait-lock a
+ * known channel bypasses the search altogether: a wrong guess never locks,
+ * which ib200_set_channel() notices and answers with a full search.
+ * Nothing is written to the device.
+ * @param choice VCO and sub-band learned for the channel, or NULL
+ * @return true if the autoselect is bypassed.
+ */
+static bool
+max2163_set_vco(struct ib200_handle *handle, const struct ib200_vco_choice *choice)
+{
+	bool bypass = choice && handle->user_options && handle->user_options->wait_lock;
+
+	max2163_set(handle, VAS_REG, VCO_AUTOSELECT_MASK | VAS_START_MASK,
+		(bypass ? DISABLE_VCO_AUTOSELECT : ENABLE_VCO_AUTOSELECT) | START_AT_CURR_LOADED_REGS);
+	if (choice)
+		max2163_set(handle, VCO_REG, VCO_MASK | SUB_BAND_MASK, choice->vco << 5 | choice->subband << 1);
+	else
+		max2163_set(handle, VCO_REG, VCO_MASK | SUB_BAND_MASK, VCO_1 | SUB_BAND_4);
+	return bypass;
+}
+
+/* Load the charge pump and VAS wait time of a band, or the power-up defaults if setting is NULL. Nothing is written to the device. */
+static void
+max2163_set_pll(struct ib200_handle *handle, const struct ib200_pll_setting *setting)
+{
+	unsigned char cps = CPS_AUTOMATIC, charge_pump = CHARGE_PUMP_1_5MA, wait_time = AUTOSELECT_45056_WAIT_TIME;
+
+	if (setting) {
+		cps = setting->cps_automatic ? CPS_AUTOMATIC : CPS_MANUAL;
+		charge_pump = setting->charge_pump << 6;
+		wait_time = setting->wait_time;
+	}
+	max2163_set(handle, VAS_REG, CPS_MASK | AUTOSELECT_WAIT_TIME_MASK, cps | wait_time);
+	max2163_set(handle, RDIVIDER_LSB_REG, CHARGE_PUMP_MASK, charge_pump);
+}
+
+/**
+ * Lay the register image of a channel over the MAX2163 register mirror, along
+ * with what the profile of the device knows about it. Nothing is written to
+ * the device.
+ * @return true if the VCO autoselect is bypassed, see max2163_set_vco().
+ */
+static bool
+max2163_prepare_channel(struct ib200_handle *handle, const struct ib200_channel *channel)
+{
+	max2163_set_channel(handle, channel);
+	max2163_set_pll(handle, ib200_profile_get_pll(&handle->profile, ib200_channel_band(channel)));
+	return max2163_set_vco(handle, ib200_profile_get_vco(&handle->profile, channel->number));
+}
+
+/* Look a channel up in the table of the handle, if any */
+static const struct ib200_channel *
+ib200_find_channel(struct ib200_handle *handle, int number)
+{
+	const struct ib200_channel *channel = NULL;
+
+	if (handle->channels)
+		channel = ib200_channel_get(handle->channels, number);
+	if (! channel)
+		debug_printf("Warning: channel %d is not in the channel table.", number);
+	return channel;
+}
+
+/**
+ * Initialize the MAX2163 to a reasonable configuration.
+ * @param channel channel to tune to right away, or NULL to keep the default
+ * band and N-Divider. Either way each register is written only once.
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_max2163_init(struct ib200_handle *handle, const struct ib200_channel *channel)
+{
+	/* Nothing is known about the register contents after power-up */
+	max2163_forget(handle);
+	max2163_load_defaults(handle);
+	if (channel)
+		max2163_prepare_channel(handle, channel);
+
+	return max2163_commit(handle);
+}
+
+/* We don't actually know whether or not this is executable firmware code to be run on the device internal microcontroller.
+   It could as well be simply an innitialization data buffer. */
+static const unsigned char ib200_builtin_firmware[56] = {
+	0x01, 0x01, 0x04, 0x08, 0x05, 0x01, 0x06, 0x00, 
+	0x15, 0xf8, 0x19, 0xcc, 0x4d, 0x08, 0x70, 0x02, 
+	0x08, 0x28, 0x09, 0x10, 0x40, 0x0d, 0x43, 0xf8, 
+	0x47, 0xc0, 0x48, 0x7f, 0xa1, 0x40, 0xa5, 0x4c, 
+	0xb9, 0xd9, 0xac, 0x01, 0xad, 0x80, 0xae, 0x43, 
+	0xaf, 0x01, 0xb0, 0x22, 0xbd, 0xe9, 0xc0, 0x1c, 
+	0xc4, 0x20, 0xc5, 0x04, 0xca, 0x33, 0x01, 0x02
+};
+
+/* CRC-32 (IEEE 802.3), as computed by zlib's crc32() */
+static uint32_t
+ib200_crc32(const unsigned char *data, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int bit;
+
+	for (i=0; i<size; ++i) {
+		crc ^= data[i];
+		for (bit=0; bit<8; ++bit)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/**
+ * Map a firmware blob produced by firmware-cutter.py.
+ * @param path file to load
+ * @param firmware output, to be released with ib200_firmware_release()
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_firmware_load(const char *path, struct ib200_firmware *firmware)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -errno;
+	}
+	if (st.st_size == 0 || st.st_size > IB200_FW_MAX_SIZE || st.st_size % 2) {
+		fprintf(stderr, "%s: firmware must have an even size of up to %d bytes\n", path, IB200_FW_MAX_SIZE);
+		close(fd);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -errno;
+	}
+
+	firmware->map = map;
+	firmware->map_size = st.st_size;
+	firmware->data = map;
+	firmware->size = st.st_size;
+	firmware->checksum = ib200_crc32(firmware->data, firmware->size);
+	debug_printf("%s: %d bytes, checksum %08x", path, (int) firmware->size, firmware->checksum);
+	return 0;
+}
+
+void
+ib200_firmware_release(struct ib200_firmware *firmware)
+{
+	if (firmware->map)
+		munmap(firmware->map, firmware->map_size);
+	memset(firmware, 0, sizeof(*firmware));
+}
+
+/**
+ * Read the checksum of the firmware last uploaded from the marker registers.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_fw_read_marker(struct ib200_handle *handle, uint32_t *checksum)
+{
+	unsigned char value;
+	int i, ret;
+
+	*checksum = 0;
+	for (i=0; i<4; ++i) {
+		ret = ib200_smi_read(handle, IB200_FW_MARKER_REG + i, &value);
+		if (ret < 0)
+			return ret;
+		*checksum |= (uint32_t) value << (8 * i);
+	}
+	return 0;
+}
+
+/* Queue the writes of the checksum of the firmware just uploaded to the marker registers */
+static int
+ib200_fw_write_marker(struct ib200_handle *handle, uint32_t checksum)
+{
+	unsigned char data[8] = { 0x15, 0x00, 0x00, 0x18, 0x01, 0x00, 0x00, 0x74 };
+	int i, ret;
+
+	for (i=0; i<4; ++i) {
+		data[1] = IB200_FW_MARKER_REG + i;
+		data[2] = (checksum >> (8 * i)) & 0xff;
+		ret = ib200_smi_write(handle, 0x0b, data);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* The firmware to upload: the one given with --firmware, or the built-in one */
+static void
+ib200_fw_blob(struct ib200_handle *handle, const unsigned char **data, size_t *size, uint32_t *checksum)
+{
+	if (handle->firmware) {
+		*data = handle->firmware->data;
+		*size = handle->firmware->size;
+		*checksum = handle->firmware->checksum;
+	} else {
+		*data = ib200_builtin_firmware;
+		*size = sizeof(ib200_builtin_firmware);
+		*checksum = ib200_crc32(*data, *size);
+	}
+}
+
+/**
+ * Upload the firmware given with --firmware, or the built-in one. The upload
+ * is skipped when, with --firmware-marker, the marker registers show that the
+ * device already runs the same blob, unless --force-firmware was given. The chunks are queued as a
+ * single batch, with up to --firmware-window of them in flight, and fenced
+ * once.
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_upload_firmware(struct ib200_handle *handle)
+{
+	struct user_options *user_options = handle->user_options;
+	const unsigned char *firmware;
+	size_t size;
+	uint32_t checksum, marker;
+	int i, ret = 0, fence, window = IB200_FW_WINDOW;
+	bool force = false, use_marker = false;
+	uint64_t start = ib200_now();
+	unsigned char cmd[13] = { 0x0b, 0xee, 0xc0, 0x01, 0x01, 0x00, 0x00, 0xba, 0xe6, 0x44, 0x9f, 0x3e, 0x58 };
+
+	if (user_options) {
+		if (user_options->firmware_window)
+			window = user_options->firmware_window;
+		force = user_options->force_firmware;
+		use_marker = user_options->firmware_marker;
+	}
+	ib200_fw_blob(handle, &firmware, &size, &checksum);
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+
+	/* Do not blame the upload for errors of earlier requests */
+	ret = ib200_cmd_fence(handle);
+	if (ret < 0)
+		goto out_unlock;
+
+	if (use_marker && ! force) {
+		ret = ib200_fw_read_marker(handle, &marker);
+		if (ret < 0)
+			goto out_unlock;
+		if (marker == checksum) {
+			debug_printf("firmware %08x is already uploaded", checksum);
+			handle->state.firmware_checksum = checksum;
+			goto out_unlock;
+		}
+	}
+
+	window = ib200_cmd_set_window(handle, window);
+	for (i=0; i<size && ret == 0; i+=2) {
+		cmd[5] = firmware[i];
+		cmd[6] = firmware[i+1];
+		ret = ib200_cmd_write(handle, cmd, sizeof(cmd), IB200_CMD_DELAY_AUTO);
+		if (ret < 0)
+			debug_printf("failed to queue firmware chunk %d: error %d", i / 2, ret);
+	}
+
+	/* Wait for the chunks in flight even on errors */
+	fence = ib200_cmd_fence(handle);
+	ib200_cmd_set_window(handle, window);
+	if (ret == 0)
+		ret = fence;
+	if (ret == 0 && use_marker)
+		ret = ib200_fw_write_marker(handle, checksum);
+	if (ret == 0)
+		ret = ib200_cmd_fence(handle);
+	if (ret == 0) {
+		handle->state.firmware_checksum = checksum;
+		debug_printf("uploaded %d bytes of firmware %08x in %llu usecs", (int) size, checksum,
+			(unsigned long long) (ib200_now() - start));
+	}
+
+out_unlock:
+	ib200_unlock(handle);
+	return ret;
+}
+	
+int
+ib200_init_ep82(struct ib200_handle *handle)
+{
+	int ret;
+	unsigned char value;
+	unsigned char data[8] = { 0x15, 0x80, 0x00, 0x18, 0x01, 0x00, 0x00, 0x74 };
 
-	/* \x0b\x00\x00\x82\x01\x00\x3b\x00\x00\x00\x00\x00\xea */
-	memcpy(data, "\x00\x3b\x00\x00\x00\x00\x00\xea", 8);
-	ret = ib200_endpoint_write(devh, addr, 0x0b, 0x00, data);
+	ret = ib200_smi_read(handle, 0x80, &value);
 	if (ret < 0)
 		return ret;
 
-	/* XXX: in another log I noticed 0xf9 instead of 0x39 */
-	/* \x0b\xee\xc4\x01\x01\x02\x01\x00\x58\x39\x52\xba\x0d */
-	ret = ib200_shadow_write(devh, 0xba523958, 0x0d);
+	data[2] = value | 0x40;
+	ret = ib200_smi_write(handle, 0x0b, data);
 	if (ret < 0)
 		return ret;
 
-	return 0;
+	return ib200_cmd_fence(handle);
 }
 
 /**
- * Initialize the MAX2163 to a reasonable configuration.
+ * Select the device configuration and claim its interface. The device has
+ * only one of each.
+ * @return 0 on success or a negative value on error.
  */
-int
-ib200_max2163_init(libusb_device_handle *devh)
+static int
+ib200_claim_interface(struct ib200_handle *handle)
 {
-	int i, ret;
-	unsigned char magic_number;
-	uint16_t addr = (MAX2163_I2C_WRITE_ADDR << 8) | MAX2163_I2C_WRITE_ADDR;
+	uint64_t t = ib200_now();
+	int ret;
 
-	/* Initialize the IF Filter Register */
-//OBS: Datasheet suggests using BIAS_CURRENT_01 upon power-up
-//     but the observed log uses BIAS_CURRENT_11
-	magic_number = 0x33;
-	ret = ib200_i2c_write(devh, addr, IF_FILTER_REG, 
-			BANDWIDTH_13MHZ | BIAS_CURRENT_11 | 
-			FLTS_INTERNAL | CENTER_FREQUENCY_1_00,
-			magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, IF_FILTER_REG, magic_number);
+	/* Specify which bConfiguration to use. This device has only one. */
+	ret = libusb_set_configuration(handle->devh, 1);
 	if (ret < 0) {
-		debug_printf("Failed to configure the IF Filter Register");
+		debug_printf("libusb_set_configuration: failed with error %d", ret);
 		return ret;
 	}
+	t = ib200_phase_done(handle, IB200_PHASE_SET_CONFIGURATION, t);
 
-
-	/* Initialize the VAS Register */
-	magic_number = 0x6e;
-	ret = ib200_i2c_write(devh, addr, VAS_REG, 
-                          START_AT_CURR_LOADED_REGS | ENABLE_VCO_AUTOSELECT |
-                          CPS_AUTOMATIC | DISABLE_ADC_LATCH | ENABLE_ADC_READ | AUTOSELECT_45056_WAIT_TIME,
-                          magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, VAS_REG, magic_number);
+	/* Specify which bInterfaceNumber to use. This device has only one. */
+	ret = libusb_claim_interface(handle->devh, 0);
 	if (ret < 0) {
-		debug_printf("Failed to configure the VAS Register");
+		debug_printf("libusb_claim_interface: failed with error %d", ret);
 		return ret;
 	}
+	ib200_phase_done(handle, IB200_PHASE_CLAIM_INTERFACE, t);
 
-	/* Initialize the VCO Register */
-	magic_number = 0xaa;
-	ret = ib200_i2c_write(devh, addr, VCO_REG, 
-			              VCO_1 | SUB_BAND_4 | VCOB_LOW_POWER,
-                          magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, VCO_REG, magic_number);
-	if (ret < 0) {
-		debug_printf("Failed to configure the VCO Register");
-		return ret;
-	}
+	handle->state.configured = true;
+	return 0;
+}
 
-	/* Initialize the PDET/RF-FILT Register */
-	magic_number = 0xe6;
-	ret = ib200_i2c_write(devh, addr, RF_FILTER_REG, 
-			              UHF_RANGE_710_806MHZ | PWRDET_BUF_ON_GC1,
-                          magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, RF_FILTER_REG, magic_number);
-	if (ret < 0) {
-		debug_printf("Failed to configure the PDET/RF-FILT Register");
-		return ret;
-	}
+int ib200_get_status(struct ib200_handle *handle, struct max2163_status *status);
 
-	/* Initialize the MODE Register */
-	magic_number = 0x22;
-	ret = ib200_i2c_write(devh, addr, MODE_REG, 
-                          HIGH_SIDE_INJECTION | ENABLE_RF_FILTER | ENABLE_3RD_STAGE_RFVGA,
-                          magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, MODE_REG, magic_number);
-	if (ret < 0) {
-		debug_printf("Failed to configure the MODE Register");
-		return ret;
-	}
+/**
+ * Take over a device that a previous run already initialized, without
+ * running the init sequence again. The device is considered initialized when
+ * it is in configuration 1, the firmware marker (see --firmware-marker) matches
+ * the firmware we would upload, and the MAX2163 did not power cycle since its
+ * status was last read. The EP 0x82 setup bit (0x40 of SMI register 0x80) is
+ * no evidence, as the captures read it back cleared after it was set: it is
+ * set again instead. None of this was confirmed on hardware yet.
+ * @return 0 if the device was taken over, 1 if it needs a full init, or a
+ * negative value on error.
+ */
+static int
+ib200_warm_start(struct ib200_handle *handle)
+{
+	const unsigned char *firmware;
+	struct max2163_status status;
+	uint32_t checksum, marker;
+	size_t size;
+	int ret, config;
 
-	/* Initialize the R-Divider MSB Register */
-	magic_number = 0x5d;
-	ret = ib200_i2c_write(devh, addr, RDIVIDER_MSB_REG, 
-			/* TODO:0x38 */ PLL_MOST_RDIVIDER(DEFAULT_RDIVIDER),
-			magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, RDIVIDER_MSB_REG, magic_number);
-	if (ret < 0) {
-		debug_printf("Failed to configure the R-Divider MSB Register");
-		return ret;
-	}
-	
-	/* Initialize the R-Divider LSB/CP Register */
-	magic_number = 0x99;
-	ret = ib200_i2c_write(devh, addr, RDIVIDER_LSB_REG, 
-                          PLL_LEAST_RDIVIDER(DEFAULT_RDIVIDER) |
-                          RFDA_37DB | ENABLE_RF_DETECTOR | CHARGE_PUMP_1_5MA,
-			magic_number, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, RDIVIDER_LSB_REG, magic_number);
+	ret = libusb_get_configuration(handle->devh, &config);
+	if (ret < 0 || config != 1)
+		return ret < 0 ? ret : 1;
+
+	ret = libusb_claim_interface(handle->devh, 0);
 	if (ret < 0) {
-		debug_printf("Failed to configure the R-Divider LSB/CP Register");
+		debug_printf("libusb_claim_interface: failed with error %d", ret);
 		return ret;
 	}
+	handle->state.configured = true;
 
-	/* Initialize the N-Divider MSB Register */
-	magic_number = 0xd5;
-	ret = ib200_i2c_write(devh, addr, NDIVIDER_MSB_REG, 
-			PLL_MOST_NDIVIDER(DEFAULT_NDIVIDER),
-			magic_number, /* reg offset: */ 0x00);
+	ib200_fw_blob(handle, &firmware, &size, &checksum);
+	ret = ib200_fw_read_marker(handle, &marker);
+	if (ret == 0 && marker != checksum)
+		ret = 1;
 	if (ret == 0)
-		ret = ib200_shadow_write(devh, NDIVIDER_MSB_REG, magic_number);
-	if (ret < 0) {
-		debug_printf("Failed to configure the N-Divider MSB Register");
-		return ret;
+		ret = ib200_get_status(handle, &status);
+	if (ret == 0 && status.pwr_cycle)
+		ret = 1;
+	if (ret == 0) {
+		ret = libusb_set_interface_alt_setting(handle->devh, 0, 1);
+		if (ret < 0)
+			debug_printf("libusb_set_interface_alt_setting: failed with error %d", ret);
 	}
-	
-	/* Initialize the N-Divider LSB/LIN Register */
-	magic_number = 0x11;
-	ret = ib200_i2c_write(devh, addr, NDIVIDER_LSB_REG, 
-			STBY_NORMAL | RFVGA_NORMAL |
-			MIX_NORMAL | PLL_LEAST_NDIVIDER(DEFAULT_NDIVIDER),
-			magic_number, /* reg offset: */ 0x00);
 	if (ret == 0)
-		ret = ib200_shadow_write(devh, NDIVIDER_LSB_REG, magic_number);
-	if (ret < 0) {
-		debug_printf("Failed to configure the N-Divider LSB/LIN Register");
-		return ret;
-	}
-
-	/* Initialize non-documented registers */
-	unsigned char magic_nums[] = {0x4c,0x88,0xc4,0x00,0x3b,0x77};
-	for (i=0x11; i<=0x16; ++i) {
-		unsigned char cmd[13] = { 0x0b, (addr>>8) & 0xff, addr & 0xff, 0x01, 0x01, i, 0, 0, i-0x11, 0, 0, 0, magic_nums[i-0x11] };
-		printf("USBOUT >>> %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-		libusb_control_transfer(devh, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT, 
-			1, 0x0b, 0x00, cmd, sizeof(cmd), 1000);
-	/* Based on log analysis:
-     For some unknown reason, the last non-documented register lacks a corresponding shadow write... */
-		if (i < 0x16)
-			ib200_shadow_write(devh, (i-0x11), magic_nums[i-0x11]);
-	}
-
-	return 0;
-}
-
-int
-ib200_upload_firmware(libusb_device_handle *devh)
-{
-/* We don't actually know whether or not this is executable firmware code to be run on the device internal microcontroller.
-   It could as well be simply an innitialization data buffer. */
-	int i, ret;
-	uint16_t wValue, wIndex;
-	uint8_t bmRequestType, bRequest;
-	unsigned char firmware[56] = {
-		0x01, 0x01, 0x04, 0x08, 0x05, 0x01, 0x06, 0x00, 
-		0x15, 0xf8, 0x19, 0xcc, 0x4d, 0x08, 0x70, 0x02, 
-		0x08, 0x28, 0x09, 0x10, 0x40, 0x0d, 0x43, 0xf8, 
-		0x47, 0xc0, 0x48, 0x7f, 0xa1, 0x40, 0xa5, 0x4c, 
-		0xb9, 0xd9, 0xac, 0x01, 0xad, 0x80, 0xae, 0x43, 
-		0xaf, 0x01, 0xb0, 0x22, 0xbd, 0xe9, 0xc0, 0x1c, 
-		0xc4, 0x20, 0xc5, 0x04, 0xca, 0x33, 0x01, 0x02
-	};
-	unsigned char cmd[13] = { 0x0b, 0xee, 0xc0, 0x01, 0x01, 0x00, 0x00, 0xba, 0xe6, 0x44, 0x9f, 0x3e, 0x58 };
-
-	bRequest = 1;
-	wValue = 0x0b;
-	wIndex = 0x00;
-	bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
-	for (i=0; i<sizeof(firmware); i+=2) {
-		cmd[5] = firmware[i];
-		cmd[6] = firmware[i+1];
-		printf("USBOUT >>> %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-		ret = libusb_control_transfer(devh, bmRequestType, bRequest, wValue, wIndex, cmd, sizeof(cmd), 1000);
-		if (ret < 0) {
-			debug_printf("libusb_control_transfer: failed with error %d", ret);
-			return ret;
-		}
-		usleep(10000);
-	}
-	return 0;
-}
-	
-int
-ib200_init_ep82(libusb_device_handle *devh)
-{
-	int ret;
-	unsigned char value;
-
-	ret = read_misterious_registers(devh, 0x80, &value);
-	if (ret < 0)
-		return ret;
+		ret = ib200_init_ep82(handle);
 
-	ret = write_misterious_registers(devh, 0x80, value|0x40); 
-	if (ret < 0)
+	if (ret != 0) {
+		/* Leave the interface as we found it, for the full init to claim */
+		libusb_release_interface(handle->devh, 0);
+		handle->state.configured = false;
 		return ret;
+	}
 
+	/* The MAX2163 image is unknown: the next commit writes whatever it sets */
+	handle->state.firmware_loaded = true;
+	handle->state.firmware_checksum = checksum;
+	handle->state.alt_setting = 1;
+	handle->state.ep82_ready = true;
+	debug_printf("device already initialized, skipping the init sequence");
 	return 0;
 }
 
+/**
+ * Bring the device up, or take it over if a previous run already did.
+ * @param number channel to tune to along with the MAX2163 init, or 0 to
+ * leave the tuning to ib200_set_channel()
+ * @return 0 on success or 1 on error.
+ */
 int
-ib200_init(struct ib200_handle *handle)
+ib200_init(struct ib200_handle *handle, int number)
 {
 	libusb_device_handle *devh = handle->devh;
-	int ret, bConfiguration, bInterfaceNumber, bAlternateSetting;
+	const struct ib200_channel *channel = NULL;
+	struct max2163_status status;
+	int ret, bInterfaceNumber, bAlternateSetting;
+	uint64_t t = ib200_now();
+
+	if (number) {
+		channel = ib200_find_channel(handle, number);
+		if (! channel)
+			return 1;
+	}
 
 	/* Check if any kernel driver already claimed this device */
 	bInterfaceNumber = 0;
@@ -794,24 +2402,30 @@ ib200_init(struct ib200_handle *handle)
 		debug_printf("Error: the kernel is already handling this device");
 		return 1;
 	}
+	t = ib200_phase_done(handle, IB200_PHASE_KERNEL_DRIVER, t);
 	
 	/* Enable LibUSB debug messages */
 	libusb_set_debug(NULL, 3);
 
-	/* Specify which bConfiguration to use. This device has only one. */
-	bConfiguration = 1;
-	ret = libusb_set_configuration(devh, bConfiguration);
-	if (ret < 0) {
-		debug_printf("libusb_set_configuration: failed with error %d", ret);
-		return 1;
+	/* Without the firmware marker there is no telling an initialized device from a fresh one */
+	if (handle->user_options && handle->user_options->firmware_marker && ! handle->user_options->cold_init) {
+		ret = ib200_warm_start(handle);
+		ib200_phase_done(handle, IB200_PHASE_WARM_PROBE, t);
+		if (ret == 0) {
+			handle->startup.warm = true;
+			return 0;
+		}
+		/* The probe is only a shortcut: whatever went wrong, run the full init */
+		if (ret < 0)
+			debug_printf("warm start probe failed with error %d, running the full init", ret);
+		/* A device that is not set up yet may well stall the probe */
+		handle->failed = false;
+		ib200_cmd_fence(handle);
 	}
 
-	/* Specify which bInterfaceNumber to use. This device has only one. */
-	ret = libusb_claim_interface(devh, bInterfaceNumber);
-	if (ret < 0) {
-		debug_printf("libusb_claim_interface: failed with error %d", ret);
+	ret = ib200_claim_interface(handle);
+	if (ret < 0)
 		return 1;
-	}
 
 
 
@@ -834,21 +2448,30 @@ ib200_init(struct ib200_handle *handle)
 #endif
 
 	/* Initialize the Configuration Descriptor */
-	ret = ib200_init_configuration_descriptor(devh);
+	t = ib200_now();
+	ret = ib200_init_configuration_descriptor(handle);
 	if (ret < 0)
 		return 1;
 
     usleep(1000);
+	t = ib200_phase_done(handle, IB200_PHASE_CONFIG_DESCRIPTOR, t);
 
 	/* Initialize the MAX2163 registers */
-	ret = ib200_max2163_init(devh);
+	ret = ib200_max2163_init(handle, channel);
 	if (ret < 0)
 		return 1;
 
+	/* Reading the status clears its PWR bit, which ib200_warm_start() looks at. Only a later warm start needs it */
+	if (ib200_get_status(handle, &status) < 0)
+		debug_printf("Failed to read the MAX2163 status: the next run will not start warm");
+	t = ib200_phase_done(handle, IB200_PHASE_MAX2163_INIT, t);
+
 	/* Upload firmware */
-	ret = ib200_upload_firmware(devh);
+	ret = ib200_upload_firmware(handle);
 	if (ret < 0)
 		return 1;
+	handle->state.firmware_loaded = true;
+	t = ib200_phase_done(handle, IB200_PHASE_FIRMWARE, t);
 
 
 /* TODO: What does URB #69 in logs/Log/lucasvr-01-hotplug.log do?
@@ -870,297 +2493,1032 @@ ib200_init(struct ib200_handle *handle)
 		debug_printf("libusb_set_interface_alt_setting: failed with error %d", ret);
 		return 1;
 	}
+	handle->state.alt_setting = bAlternateSetting;
+	t = ib200_phase_done(handle, IB200_PHASE_ALT_SETTING, t);
+
+	/* Black magic */
+	ret = ib200_init_ep82(handle);
+	if (ret < 0)
+		return 1;
+	ib200_phase_done(handle, IB200_PHASE_EP82, t);
+	handle->state.ep82_ready = true;
+
+	return 0;
+}
+
+int ib200_set_channel(struct ib200_handle *handle, int number);
+
+/* A device being brought up by ib200_init_parallel() */
+struct ib200_bringup {
+	struct ib200_handle *handle;
+	int channel;
+	uint64_t start;      /* in usecs */
+	int ret;
+	pthread_t thread;
+};
+
+static void *
+ib200_bringup_thread(void *arg)
+{
+	struct ib200_bringup *bringup = (struct ib200_bringup *) arg;
+	struct ib200_handle *handle = bringup->handle;
+
+	bringup->ret = ib200_init(handle, bringup->channel);
+	if (bringup->ret == 0 && bringup->channel)
+		bringup->ret = ib200_set_channel(handle, bringup->channel);
+
+	printf("device %03d:%03d: %s after %llu usecs (%s start)\n",
+		handle->bus_number, libusb_get_device_address(handle->dev),
+		bringup->ret == 0 ? "ready" : "failed",
+		(unsigned long long) (ib200_now() - bringup->start),
+		handle->startup.warm ? "warm" : "cold");
+	fflush(stdout);
+	return NULL;
+}
+
+/**
+ * Initialize several devices at once, one thread per device, and tune each
+ * of them. A line is printed as each device becomes ready, so the slowest
+ * device does not hold back the report of the others. The devices share the
+ * libusb context: whichever thread handles events completes the transfers
+ * of every device.
+ * @param handles devices to bring up
+ * @param count number of devices
+ * @param channel channel to tune to, or 0
+ * @param rets output: the result of each device, 0 if it is ready
+ * @return the number of devices that failed.
+ */
+int
+ib200_init_parallel(struct ib200_handle **handles, int count, int channel, int *rets)
+{
+	struct ib200_bringup *bringup;
+	uint64_t start = ib200_now();
+	int i, failed = 0;
+
+	bringup = calloc(count, sizeof(struct ib200_bringup));
+	if (! bringup) {
+		perror("calloc");
+		for (i=0; i<count; ++i)
+			rets[i] = -ENOMEM;
+		return count;
+	}
+
+	for (i=0; i<count; ++i) {
+		bringup[i].handle = handles[i];
+		bringup[i].channel = channel;
+		bringup[i].start = start;
+		if (pthread_create(&bringup[i].thread, NULL, ib200_bringup_thread, &bringup[i]) != 0) {
+			/* Bring this one up from here instead */
+			ib200_bringup_thread(&bringup[i]);
+			bringup[i].thread = pthread_self();
+		}
+	}
+
+	for (i=0; i<count; ++i) {
+		if (! pthread_equal(bringup[i].thread, pthread_self()))
+			pthread_join(bringup[i].thread, NULL);
+		rets[i] = bringup[i].ret;
+		if (bringup[i].ret != 0)
+			failed++;
+	}
+
+	printf("%d of %d devices ready after %llu usecs\n", count - failed, count,
+		(unsigned long long) (ib200_now() - start));
+	free(bringup);
+	return failed;
+}
+
+/**
+ * Look the device up again after it re-enumerated, on the same bus.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_reopen(struct ib200_handle *handle)
+{
+	libusb_device **devlist;
+	libusb_device_handle *devh;
+	ssize_t i, n;
+	int try, ret = LIBUSB_ERROR_NO_DEVICE;
+
+	libusb_close(handle->devh);
+	handle->devh = NULL;
+
+	for (try=0; try<IB200_REOPEN_TRIES && ret == LIBUSB_ERROR_NO_DEVICE; ++try) {
+		if (try)
+			usleep(IB200_REOPEN_INTERVAL);
+
+		n = libusb_get_device_list(handle->ctx, &devlist);
+		if (n < 0)
+			return n;
+
+		for (i=0; i<n; ++i) {
+			libusb_device *dev = devlist[i];
+			struct libusb_device_descriptor desc;
+
+			if (libusb_get_device_descriptor(dev, &desc) < 0 ||
+				desc.idVendor != ZINWELL_VENDOR_ID || desc.idProduct != IB200_PRODUCT_ID ||
+				libusb_get_bus_number(dev) != handle->bus_number)
+				continue;
+
+			ret = libusb_open(dev, &devh);
+			if (ret < 0) {
+				debug_printf("libusb_open: failed with error %d", ret);
+				break;
+			}
+			if (handle->dev_ref)
+				libusb_unref_device(handle->dev);
+			handle->dev = libusb_ref_device(dev);
+			handle->dev_ref = true;
+			handle->devh = devh;
+			break;
+		}
+		libusb_free_device_list(devlist, 1);
+	}
+	return ret;
+}
+
+/**
+ * Whether a transfer stalled or the device went away since the last recovery.
+ */
+bool
+ib200_needs_recovery(struct ib200_handle *handle)
+{
+	return handle->failed;
+}
+
+/**
+ * Bring the device back after a stall or a reset without a full ib200_init:
+ * reset the port (or reopen the device if it re-enumerated) and replay the
+ * state cached in the handle. Isochronous transfers that failed meanwhile
+ * are accounted for in pending_requests, so the streaming loop resubmits them.
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_recover(struct ib200_handle *handle)
+{
+	struct ib200_state *state = &handle->state;
+	uint64_t start = handle->failed ? handle->failed_at : ib200_now();
+	uint64_t deadline, outage;
+	bool reopened = false;
+	int ret;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+
+	/* Let the requests and the isochronous transfers in flight fail */
+	ib200_cmd_fence(handle);
+	deadline = ib200_now() + IB200_CMD_TIMEOUT * 1000;
+	while (handle->pending_requests > 0 && ib200_now() < deadline)
+		ib200_cmd_handle_events(handle, NULL);
+
+	ret = libusb_reset_device(handle->devh);
+	if (ret == LIBUSB_ERROR_NOT_FOUND || ret == LIBUSB_ERROR_NO_DEVICE) {
+		debug_printf("device re-enumerated, looking it up again");
+		ret = ib200_reopen(handle);
+		reopened = true;
+	}
+	if (ret < 0) {
+		debug_printf("failed to reset the device: %s", libusb_error_name(ret));
+		goto out_unlock;
+	}
+
+	/* A reopened device went through a power cycle: redo the early bring-up */
+	if (reopened && state->configured) {
+		ret = ib200_claim_interface(handle);
+		if (ret == 0 && ib200_init_configuration_descriptor(handle) != 0)
+			ret = -EIO;
+		if (ret < 0)
+			goto out_unlock;
+	}
+
+	/* Nothing is known about the SMI-2020CBE registers after a reset */
+	ib200_smi_forget(handle);
+
+	/* Write back the last MAX2163 image */
+	max2163_forget(handle);
+	ret = max2163_commit(handle);
+	if (ret < 0)
+		goto out_unlock;
+
+	if (reopened && state->firmware_loaded) {
+		ret = ib200_upload_firmware(handle);
+		if (ret < 0)
+			goto out_unlock;
+	}
+
+	if (state->alt_setting >= 0) {
+		ret = libusb_set_interface_alt_setting(handle->devh, 0, state->alt_setting);
+		if (ret < 0) {
+			debug_printf("libusb_set_interface_alt_setting: failed with error %d", ret);
+			goto out_unlock;
+		}
+	}
+
+	if (state->ep82_ready) {
+		ret = ib200_init_ep82(handle);
+		if (ret < 0)
+			goto out_unlock;
+	}
+
+	outage = ib200_now() - start;
+	handle->failed = false;
+	handle->outages++;
+	handle->outage_time += outage;
+	if (outage > handle->max_outage)
+		handle->max_outage = outage;
+	debug_printf("recovered after %llu usecs (%s)", (unsigned long long) outage,
+		reopened ? "device reopened" : "port reset");
+
+out_unlock:
+	ib200_unlock(handle);
+	return ret;
+}
+
+int
+usb_out(struct ib200_handle *handle, unsigned char v0, unsigned char v1,  
+	unsigned char v2, unsigned char v3, unsigned char v4, unsigned char v5, 
+	unsigned char v6, unsigned char v7, unsigned char v8, unsigned char v9, 
+	unsigned char v10, unsigned char v11, unsigned char v12){
+
+	int ret;
+	unsigned char cmd[13] = {v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12};
+
+	ret = ib200_cmd_write(handle, cmd, sizeof(cmd), IB200_CMD_DELAY_AUTO);
+	IB200_PROBE3(usb__out, cmd, sizeof(cmd), ret);
+	if (ret < 0) {
+		debug_printf("ib200_cmd_write: failed with error %d", ret);
+		return ret;
+	}
+	return 0;
+}
+
+/* Progress of a sequence whose IN steps are being verified as they complete */
+struct ib200_seq_run {
+	const struct ib200_seq_op *ops;
+	int checked;      /* last IN step verified */
+	int mismatches;
+};
+
+/* Compare a response against an IN step, looking only at the bits in its mask */
+static bool
+ib200_seq_matches(const struct ib200_seq_op *op, unsigned char *data, int length)
+{
+	unsigned char diff = 0;
+	int i;
+
+	if (length != IB200_SEQ_CMD_SIZE)
+		return false;
+	for (i=0; i<IB200_SEQ_CMD_SIZE; ++i)
+		diff |= (data[i] ^ op->data[i]) & op->mask[i];
+	return diff == 0;
+}
+
+/* Completion callback of IN steps. Control transfers complete in order. */
+static void
+ib200_seq_verify(struct ib200_handle *handle, int status,
+	unsigned char *data, int length, void *user_data)
+{
+	struct ib200_seq_run *run = (struct ib200_seq_run *) user_data;
+	const struct ib200_seq_op *op;
+	int i;
+
+	do
+		run->checked++;
+	while (run->ops[run->checked].op != IB200_SEQ_IN);
+	op = &run->ops[run->checked];
+
+	if (status < 0 || ib200_seq_matches(op, data, length))
+		return;
+
+	run->mismatches++;
+	printf("step %d: RECEIVED:", run->checked);
+	for (i=0; i<length; ++i)
+		printf(" %02X", data[i]);
+	printf("\nstep %d: EXPECTED:", run->checked);
+	for (i=0; i<IB200_SEQ_CMD_SIZE; ++i)
+		printf(op->mask[i] ? " %02X" : " ??", op->data[i]);
+	printf(" (USB response was different than what we expected to receive!)\n\n");
+}
+
+/**
+ * Run a sequence of vendor commands. Steps are pipelined: IN steps are
+ * verified by their completion callbacks, so only settle times hold the
+ * queue back. The sequence stops at the first unexpected response. Writes
+ * that would not change a cached SMI-2020CBE register are skipped.
+ * @param ops steps to run
+ * @param count number of steps
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_seq_execute(struct ib200_handle *handle, const struct ib200_seq_op *ops, int count)
+{
+	uint8_t bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
+	struct ib200_seq_run run = { ops, -1, 0 };
+	unsigned int delay;
+	bool smi_write;
+	int i, ret = 0, fence;
+
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	for (i=0; i<count && ret == 0 && run.mismatches == 0; ++i) {
+		const struct ib200_seq_op *op = &ops[i];
+
+		switch (op->op) {
+			case IB200_SEQ_OUT:
+				/* SMI-2020CBE register writes go through the register cache */
+				smi_write = ! memcmp(&op->data[1], "\x00\x00\x82\x01", 4);
+				if (smi_write && ib200_smi_redundant(handle, &op->data[5]))
+					break;
+				ret = ib200_cmd_write(handle, (unsigned char *) op->data, IB200_SEQ_CMD_SIZE, op->delay);
+				if (! smi_write)
+					break;
+				/* As in ib200_smi_write, only cache what the device acknowledged */
+				if (ret == 0)
+					ret = ib200_cmd_fence(handle);
+				if (ret == 0)
+					ib200_smi_store(handle, &op->data[5]);
+				else
+					ib200_smi_unknown(handle, &op->data[5]);
+				break;
+			case IB200_SEQ_IN:
+				delay = op->delay == IB200_SEQ_DELAY_AUTO ? ib200_cmd_delay((unsigned char *) op->data, true) : op->delay;
+				ret = ib200_cmd_submit(handle, bmRequestType, op->data[0], NULL, IB200_SEQ_CMD_SIZE,
+					delay, ib200_seq_verify, &run);
+				break;
+			default:
+				debug_printf("step %d: invalid op %d", i, op->op);
+				ret = -EINVAL;
+		}
+	}
+
+	/* The callbacks refer to run: wait for them even on errors */
+	fence = ib200_cmd_fence(handle);
+	ib200_unlock(handle);
 
-	/* Black magic */
-	ret = ib200_init_ep82(devh);
-	if (ret < 0)
-		return 1;
+	if (ret == 0)
+		ret = fence;
+	if (ret == 0 && run.mismatches)
+		ret = -EIO;
+	return ret;
+}
 
-	return 0;
+static uint32_t
+ib200_get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
 }
 
+/**
+ * Load a sequence file. See sequence.h for the format.
+ * @param path file to load
+ * @param ops output: the steps, to be released with free()
+ * @return the number of steps on success or a negative value on error.
+ */
 int
-usb_in(libusb_device_handle *devh, unsigned char v0, unsigned char v1,  
-	unsigned char v2, unsigned char v3, unsigned char v4, unsigned char v5, 
-	unsigned char v6, unsigned char v7, unsigned char v8, unsigned char v9, 
-	unsigned char v10, unsigned char v11, unsigned char v12){
-
-	int ret;
-	uint8_t bmRequestType, bRequest;
-	unsigned char buf[13];
-	unsigned char *cmd;
+ib200_seq_load(const char *path, struct ib200_seq_op **ops)
+{
+	unsigned char header[IB200_SEQ_HEADER_SIZE], step[IB200_SEQ_STEP_SIZE];
+	uint32_t i, count;
+	FILE *fp;
 
-	bRequest = 1;
-	bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
-	ret = libusb_control_transfer(devh, bmRequestType, bRequest, 0x0b, 0x00, buf, sizeof(buf), 1000);
-	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
-		return ret;
+	fp = fopen(path, "r");
+	if (! fp) {
+		perror(path);
+		return -errno;
 	}
 
-	cmd=buf;
-	printf("USBIN  <<<  %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-
-	usleep(10000);
+	if (fread(header, sizeof(header), 1, fp) != 1 ||
+		memcmp(header, IB200_SEQ_MAGIC, 8) || header[8] != IB200_SEQ_VERSION) {
+		fprintf(stderr, "%s: not a version %d sequence file\n", path, IB200_SEQ_VERSION);
+		fclose(fp);
+		return -EINVAL;
+	}
 
-	if (v0!=buf[0]||v1!=buf[1]||v2!=buf[2]||v3!=buf[3]||v4!=buf[4]||v5!=buf[5]||v6!=buf[6]||
-v7!=buf[7]||v8!=buf[8]||v9!=buf[9]||v10!=buf[10]||v11!=buf[11]||v12!=buf[12])
-		{
-			printf("EXPECTED:   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X",
-				v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12 );
-			printf(" (USB response was different than what we expected to receive!)\n\n");
+	count = ib200_get_le32(&header[12]);
+	*ops = calloc(count ? count : 1, sizeof(struct ib200_seq_op));
+	if (! *ops) {
+		perror("calloc");
+		fclose(fp);
+		return -ENOMEM;
+	}
 
-//			hexdump(buf,sizeof(buf));
+	for (i=0; i<count; ++i) {
+		if (fread(step, sizeof(step), 1, fp) != 1) {
+			fprintf(stderr, "%s: truncated at step %u\n", path, i);
+			free(*ops);
+			fclose(fp);
+			return -EINVAL;
 		}
-	return 0;
+		(*ops)[i].op = step[0];
+		memcpy((*ops)[i].data, &step[1], IB200_SEQ_CMD_SIZE);
+		memcpy((*ops)[i].mask, &step[1 + IB200_SEQ_CMD_SIZE], IB200_SEQ_CMD_SIZE);
+		(*ops)[i].delay = ib200_get_le32(&step[1 + 2 * IB200_SEQ_CMD_SIZE]);
+	}
+
+	fclose(fp);
+	return count;
 }
 
+/* A MAX2163 register write bypassing the mirror, followed by its shadow write */
+#define SEQ_MAX2163(reg, val, magic) \
+	SEQ_OUT(0x0b, 0xc0, 0xc0, 0x01, 0x01, reg, val, 0x00, (reg) - 3, 0x00, 0x00, 0x00, magic), \
+	SEQ_OUT(0x0b, 0xee, 0xc4, 0x01, 0x01, 0x02, 0x01, (reg) - 3, 0x00, 0x00, 0x00, 0x00, magic)
+
+#define SEQ_LED_ON \
+	SEQ_OUT(0x00, 0x00, 0x00, 0x82, 0x01, 0x00, 0x35, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00)
+
+#define TVRECORD_RDIVIDER 0x70  /* 112 */
+#define TVRECORD_NDIVIDER 0x6f8 /* 1784 */
+
+/* Replay of logs/Log/lucasvr-02-tune_to_record.log */
+static const struct ib200_seq_op tune_to_record_seq[] = {
+	SEQ_OUT(0x0b, 0x00, 0x20, 0x82, 0x01, 0x30, 0x80, 0x89, 0x01, 0x10, 0x6b, 0x89, 0x1e),
+	SEQ_IN(SEQ_MASK_BUT(7),
+	        0x0b, 0x00, 0x20, 0x82, 0x01, 0x30, 0x80, 0x00, 0x01, 0x10, 0x6b, 0x89, 0x1e),
+
+	SEQ_OUT(0x0b, 0x00, 0x00, 0x82, 0x01, 0x30, 0x80, 0x04, 0x01, 0x10, 0x6b, 0x89, 0x1e),
+	SEQ_OUT(0x0b, 0x00, 0x00, 0x82, 0x01, 0x30, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0xbc),
+	SEQ_OUT(0x0b, 0x00, 0x00, 0x82, 0x01, 0x16, 0x00, 0x00, 0x20, 0x80, 0x0d, 0x88, 0x43),
+
+	SEQ_OUT(0x0b, 0xee, 0xc4, 0x01, 0x01, 0x02, 0x01, 0x00, 0x0b, 0x00, 0x87, 0x8f, 0x00),
+
+	SEQ_MAX2163(RF_FILTER_REG,
+		UHF_RANGE_488_512MHZ | AGC_MINUS_66DBM | PWRDET_BUF_ON_GC1,
+		/* magic number */ 0x20),
+	SEQ_MAX2163(MODE_REG,
+		HIGH_SIDE_INJECTION | ENABLE_RF_FILTER | ENABLE_3RD_STAGE_RFVGA,
+		/* magic number */ 0x5b),
+	SEQ_MAX2163(RDIVIDER_MSB_REG,
+		PLL_MOST_RDIVIDER(TVRECORD_RDIVIDER),
+		/* magic number */ 0x97),
+	SEQ_MAX2163(RDIVIDER_LSB_REG,
+		CHARGE_PUMP_1_5MA | ENABLE_RF_DETECTOR | RFDA_37DB |
+		PLL_LEAST_RDIVIDER(TVRECORD_RDIVIDER),
+		/* magic number */ 0xd3),
+	SEQ_MAX2163(NDIVIDER_MSB_REG,
+		PLL_MOST_NDIVIDER(TVRECORD_NDIVIDER),
+		/* magic number */ 0x0f),
+	SEQ_MAX2163(NDIVIDER_LSB_REG,
+		PLL_LEAST_NDIVIDER(TVRECORD_NDIVIDER) |
+		MIX_NORMAL | RFVGA_NORMAL | STBY_NORMAL,
+		/* magic number */ 0x4a),
+
+	SEQ_OUT(0x0b, 0xee, 0xc0, 0x01, 0x01, 0x18, 0x01, 0x8f, 0x03, 0x00, 0x00, 0x00, 0xc0),
+	SEQ_OUT(0x0b, 0xee, 0xc0, 0x01, 0x01, 0x18, 0x00, 0x8f, 0x03, 0x00, 0x00, 0x00, 0xc0),
+	SEQ_OUT(0x0b, 0xee, 0xc0, 0x01, 0x01, 0x01, 0x02, 0x8f, 0x03, 0x00, 0x00, 0x00, 0xc0),
+
+	SEQ_OUT(0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0xcd, 0xfd, 0x00, 0x00, 0x00, 0x00, 0x2b),
+	SEQ_IN(SEQ_MASK_BUT(6),
+	        0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x01, 0xfd, 0x00, 0x00, 0x00, 0x00, 0x2b),
+
+	SEQ_LED_ON,
+
+	SEQ_OUT(0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x00, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+	SEQ_IN(SEQ_MASK_BUT(6),
+	        0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x06, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+
+	SEQ_LED_ON,
+
+	SEQ_OUT(0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x00, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+	SEQ_IN(SEQ_MASK_BUT(6),
+	        0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x07, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+
+	SEQ_LED_ON,
+
+	SEQ_OUT(0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x00, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+	SEQ_IN(SEQ_MASK_BUT(6),
+	        0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x07, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+
+	SEQ_LED_ON,
+
+	SEQ_OUT(0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x00, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+	SEQ_IN(SEQ_MASK_BUT(6),
+	        0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x08, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+
+	SEQ_LED_ON,
+
+	SEQ_OUT(0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x00, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+	SEQ_IN(SEQ_MASK_BUT(6),
+	        0x0b, 0xee, 0xe0, 0x01, 0x01, 0x32, 0x0a, 0x88, 0x04, 0xdb, 0x87, 0x8f, 0x00),
+
+	SEQ_OUT(0x0b, 0x00, 0x20, 0x82, 0x01, 0x15, 0x80, 0x00, 0x32, 0xa7, 0x4a, 0x0b, 0x04),
+	SEQ_IN(SEQ_MASK_BUT(7),
+	        0x0b, 0x00, 0x20, 0x82, 0x01, 0x15, 0x80, 0x03, 0x32, 0xa7, 0x4a, 0x0b, 0x04),
+
+	SEQ_OUT(0x0b, 0x00, 0x00, 0x82, 0x01, 0x15, 0x80, 0xc3, 0x32, 0xa7, 0x4a, 0x0b, 0x04),
+};
+
 int
-usb_out(libusb_device_handle *devh, unsigned char v0, unsigned char v1,  
-	unsigned char v2, unsigned char v3, unsigned char v4, unsigned char v5, 
-	unsigned char v6, unsigned char v7, unsigned char v8, unsigned char v9, 
-	unsigned char v10, unsigned char v11, unsigned char v12){
+tune_to_record(struct ib200_handle *handle)
+{
+	/* The registers in the sequence are written behind the back of the MAX2163 mirror */
+	max2163_forget(handle);
+
+	return ib200_seq_execute(handle, tune_to_record_seq,
+		sizeof(tune_to_record_seq) / sizeof(tune_to_record_seq[0]));
+}
 
+/**
+ * Read the 0b ee e0 01 progress register. After a tune it steps 06, 07, 08,
+ * 0a over about 400 msecs in the captures (see tune_to_record_seq), far
+ * slower than the PLL locks: it most likely follows the demodulator sync.
+ * @return 0 on success or a negative value on error.
+ */
+static int
+ib200_read_progress(struct ib200_handle *handle, unsigned char *value)
+{
+	unsigned char cmd[IB200_CMD_SIZE], buf[IB200_CMD_SIZE];
 	int ret;
-	uint8_t bmRequestType, bRequest;
-	unsigned char cmd[13] = {v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12};
 
-	bRequest = 1;
-	bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
-	printf("USBOUT >>> %02X %02X %02X %02X   %02X %02X %02X %02X   %02X %02X %02X %02X   %02X\n", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], cmd[8], cmd[9], cmd[10], cmd[11], cmd[12]);
-	ret = libusb_control_transfer(devh, bmRequestType, bRequest, 0x0b, 0x00, cmd, sizeof(cmd), 1000);
-	if (ret < 0) {
-		debug_printf("libusb_control_transfer: failed with error %d", ret);
+	memcpy(cmd, "\x0b\xee\xe0\x01\x01\x32\x00\x88\x04\xdb\x87\x8f\x00", sizeof(cmd));
+	cmd[5] = IB200_PROGRESS_REG;
+	ret = ib200_transact(handle, cmd, sizeof(cmd), buf, sizeof(buf));
+	if (ret < 0)
 		return ret;
+	if (ret <= 6) {
+		debug_printf("short progress register response (%d bytes)", ret);
+		return -EIO;
 	}
-	usleep(10000);
+	*value = buf[6];
 	return 0;
 }
 
-#define USB_OUT(v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12)\
-	usb_out(devh, 0x##v0, 0x##v1, 0x##v2, 0x##v3, 0x##v4, 0x##v5, 0x##v6,\
-                  0x##v7, 0x##v8, 0x##v9, 0x##v10, 0x##v11, 0x##v12);
+/* The VCO search is over and the tuning voltage is off the rails */
+static bool
+max2163_locked(const struct max2163_status *status)
+{
+	return ! status->vasa && status->vtune_adc != 0 && status->vtune_adc != 7;
+}
+
+/**
+ * Wait for the PLL to lock after a tune. STATUS_REG and VAS_STATUS_REG are
+ * polled, starting IB200_LOCK_POLL_MIN apart and backing off up to
+ * IB200_LOCK_POLL_MAX, so that a fast lock is seen within a fraction of a
+ * millisecond while a slow one does not flood the control pipe. Only the
+ * synthesizer is looked at, so that a channel without broadcast locks too.
+ * @param since when the PLL registers were written, in usecs
+ * @param timeout how long after since to give up, in usecs
+ * @param lock_time output: time from since to lock, in usecs
+ * @param status output: the status registers that reported lock
+ * @return 0 on success, -ETIMEDOUT if the PLL did not lock in time or another
+ * negative value on error.
+ */
+static int
+ib200_wait_for_lock(struct ib200_handle *handle, uint64_t since, uint64_t timeout,
+	uint64_t *lock_time, struct max2163_status *lock_status)
+{
+	struct max2163_status status;
+	unsigned int interval = IB200_LOCK_POLL_MIN;
+	uint64_t now;
+	int ret, polls = 0;
 
-#define USB_IN(v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12)\
-	usb_in(devh, 0x##v0, 0x##v1, 0x##v2, 0x##v3, 0x##v4, 0x##v5, 0x##v6,\
-                  0x##v7, 0x##v8, 0x##v9, 0x##v10, 0x##v11, 0x##v12);
+	while (true) {
+		/* Cached samples predate the tune */
+		ib200_status_invalidate(handle);
+		ret = ib200_get_status(handle, &status);
+		if (ret < 0)
+			return ret;
+		polls++;
 
-void
-max2163_write_i2c(libusb_device_handle *devh, char reg, char val, char magic){
-    int ret;
-    int address = (MAX2163_I2C_WRITE_ADDR << 8) | MAX2163_I2C_WRITE_ADDR;
+		if (max2163_locked(&status))
+			break;
 
-	ret = ib200_i2c_write(devh, address, reg, val, magic, /* reg offset: */ 3);
-	if (ret < 0) {
-		debug_printf("Failed to write to MAX2163 i2c register\n");
-		return;
+		now = ib200_now();
+		if (now - since >= timeout) {
+			debug_printf("PLL did not lock after %d polls: VTUNE ADC %d, VAS %s",
+				polls, status.vtune_adc, status.vasa ? "active" : "done");
+			IB200_PROBE3(pll__lock, polls, now - since, -ETIMEDOUT);
+			return -ETIMEDOUT;
+		}
+		if (now - since + interval > timeout)
+			interval = timeout - (now - since);
+		usleep(interval);
+		if (interval < IB200_LOCK_POLL_MAX)
+			interval = interval * 2 < IB200_LOCK_POLL_MAX ? interval * 2 : IB200_LOCK_POLL_MAX;
 	}
 
-	usb_out(devh, 0x0b, 0xee, 0xc4, 0x01, 0x01, 0x02, 0x01, reg-3, 0x00, 0x00, 0x00, 0x00, magic);
+	*lock_time = status.sampled - since;
+	*lock_status = status;
+	IB200_PROBE3(pll__lock, polls, *lock_time, 0);
+	return 0;
 }
 
-int
-tune_to_record(struct ib200_handle *handle)
+/**
+ * Wait for the progress register to reach IB200_PROGRESS_DONE after a tune,
+ * backing off from IB200_LOCK_POLL_MAX to IB200_SYNC_POLL_MAX between reads.
+ * @param since when the PLL registers were written, in usecs
+ * @param sync_time output: time from since to IB200_PROGRESS_DONE, in usecs
+ * @return 0 on success, -ETIMEDOUT if the register did not get there within
+ * IB200_SYNC_TIMEOUT, e.g. for lack of a broadcast, or another negative
+ * value on error.
+ */
+static int
+ib200_wait_for_sync(struct ib200_handle *handle, uint64_t since, uint64_t *sync_time)
 {
-	int tvrecord_reference_divider = 0x70; //112
-	int tvrecord_integer_divider = 0x6F8; //1784
+	unsigned int interval = IB200_LOCK_POLL_MAX;
+	unsigned char progress;
+	uint64_t now;
+	int ret;
 
-	libusb_device_handle *devh = handle->devh;
+	while (true) {
+		ret = ib200_read_progress(handle, &progress);
+		if (ret < 0)
+			return ret;
+		now = ib200_now();
+		if (progress >= IB200_PROGRESS_DONE)
+			break;
+		if (now - since >= IB200_SYNC_TIMEOUT) {
+			debug_printf("progress register stuck at %#04x", progress);
+			return -ETIMEDOUT;
+		}
+		usleep(interval);
+		if (interval < IB200_SYNC_POLL_MAX)
+			interval = interval * 2 < IB200_SYNC_POLL_MAX ? interval * 2 : IB200_SYNC_POLL_MAX;
+	}
 
-	USB_OUT( 0b, 00, 20, 82, 01, 30, 80, 89, 01, 10, 6b, 89, 1e)
-	USB_IN ( 0b, 00, 20, 82, 01, 30, 80, 00, 01, 10, 6b, 89, 1e)
+	*sync_time = now - since;
+	return 0;
+}
 
-	USB_OUT( 0b, 00, 00, 82, 01, 30, 80, 04, 01, 10, 6b, 89, 1e)
-	USB_OUT( 0b, 00, 00, 82, 01, 30, 80, 00, 00, 00, 00, 00, bc)
-	USB_OUT( 0b, 00, 00, 82, 01, 16, 00, 00, 20, 80, 0d, 88, 43)
+/**
+ * Tune to a given UHF channel. Only the registers of its precomputed image
+ * that differ from what the MAX2163 holds are written. With --wait-lock,
+ * returns once the PLL locked, leaving the time it took in handle->lock_time,
+ * and learns the VCO and sub-band it locked with for the next time. With
+ * --wait-sync, then waits for the progress register as well.
+ * @param handle device handle
+ * @param number channel number, as in channel_frequencies.conf
+ * @return 0 on success or a negative value on error
+ */
+int
+ib200_set_channel(struct ib200_handle *handle, int number)
+{
+	const struct ib200_channel *channel;
+	struct max2163_status status;
+	uint64_t start = ib200_now();
+	bool bypass;
+	int ret;
 
-	USB_OUT( 0b, ee, c4, 01, 01, 02, 01, 00, 0b, 00, 87, 8f, 00)
+	IB200_PROBE1(set_frequency__entry, number);
 
-	max2163_write_i2c(devh, RF_FILTER_REG,
-                      UHF_RANGE_488_512MHZ | AGC_MINUS_66DBM | PWRDET_BUF_ON_GC1,
-			  /* magic number */ 0x20);
+	channel = ib200_find_channel(handle, number);
+	if (! channel) {
+		IB200_PROBE3(set_frequency__return, number, 0, -EINVAL);
+		return -EINVAL;
+	}
 
-	max2163_write_i2c(devh, MODE_REG,
-                      HIGH_SIDE_INJECTION | ENABLE_RF_FILTER | ENABLE_3RD_STAGE_RFVGA,
-			  /* magic number */ 0x5b);
+	printf("\nChannel: %d\nFreq: %u\nN-DIV: %#x\nR-DIV: %#x\n\n", number,
+		channel->frequency, channel->n_divider, channel->r_divider);
 
-	max2163_write_i2c(devh, RDIVIDER_MSB_REG,
-                      PLL_MOST_RDIVIDER(tvrecord_reference_divider),
-			  /* magic number */ 0x97);
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	bypass = max2163_prepare_channel(handle, channel);
 
-	max2163_write_i2c(devh, RDIVIDER_LSB_REG,
-                      CHARGE_PUMP_1_5MA | ENABLE_RF_DETECTOR | RFDA_37DB |
-                      PLL_LEAST_RDIVIDER(tvrecord_reference_divider),
-			  /* magic number */ 0xd3);
+	/* Only the registers that actually changed are written */
+	ret = max2163_commit(handle);
+	ib200_unlock(handle);
+	IB200_PROBE3(set_frequency__return, number, channel->n_divider, ret);
+	if (ret < 0) {
+		debug_printf("Failed to tune to channel %d", number);
+		return ret;
+	}
 
-	max2163_write_i2c(devh, NDIVIDER_MSB_REG,
-                      PLL_MOST_NDIVIDER(tvrecord_integer_divider),
-			  /* magic number */ 0x0f);
+	if (handle->user_options && handle->user_options->wait_lock) {
+		ret = ib200_wait_for_lock(handle, start, bypass ? IB200_LOCK_BYPASS_TIMEOUT : IB200_LOCK_TIMEOUT,
+			&handle->lock_time, &status);
+		if (ret == -ETIMEDOUT && bypass) {
+			debug_printf("Channel %d did not lock on its usual VCO, searching", number);
+			ib200_profile_forget_vco(&handle->profile, number);
+			ib200_lock(handle, IB200_PRIO_TUNE);
+			bypass = max2163_set_vco(handle, NULL);
+			ret = max2163_commit(handle);
+			ib200_unlock(handle);
+			if (ret == 0)
+				ret = ib200_wait_for_lock(handle, start, IB200_LOCK_TIMEOUT, &handle->lock_time, &status);
+		}
+		if (ret < 0) {
+			debug_printf("Failed to lock on channel %d", number);
+			return ret;
+		}
+		/* Remember where the search ended; VCO_AUTOSELECT reads 3 on no VCO at all */
+		if (! bypass && status.vco_autoselect <= 2)
+			ib200_profile_set_vco(&handle->profile, number, status.vco_autoselect, status.vco_subband);
+		printf("PLL locked after %llu usecs\n", (unsigned long long) handle->lock_time);
+	}
 
-	max2163_write_i2c(devh, NDIVIDER_LSB_REG,
-                      PLL_LEAST_NDIVIDER(tvrecord_integer_divider) |
-                      MIX_NORMAL | RFVGA_NORMAL | STBY_NORMAL,
-			  /* magic number */ 0x4a);
+	handle->startup.mark = ib200_phase_done(handle, IB200_PHASE_TUNE, start);
 
-	USB_OUT( 0b, ee, c0, 01, 01, 18, 01, 8f, 03, 00, 00, 00, c0)
-	USB_OUT( 0b, ee, c0, 01, 01, 18, 00, 8f, 03, 00, 00, 00, c0)
-	USB_OUT( 0b, ee, c0, 01, 01, 01, 02, 8f, 03, 00, 00, 00, c0)
+	if (handle->user_options && handle->user_options->wait_sync) {
+		uint64_t sync_time;
 
-	USB_OUT( 0b, ee, e0, 01, 01, 32, cd, fd, 00, 00, 00, 00, 2b)
-	USB_IN ( 0b, ee, e0, 01, 01, 32, 01, fd, 00, 00, 00, 00, 2b)
+		ret = ib200_wait_for_sync(handle, start, &sync_time);
+		if (ret == 0)
+			printf("Progress register reached %#04x after %llu usecs\n", IB200_PROGRESS_DONE,
+				(unsigned long long) sync_time);
+		else if (ret == -ETIMEDOUT)
+			printf("Progress register did not reach %#04x: no broadcast on channel %d?\n",
+				IB200_PROGRESS_DONE, number);
+		else
+			return ret;
+	}
 
-	ib200_set_LED(devh, true);
+	return 0;
+}
 
-	USB_OUT( 0b, ee, e0, 01, 01, 32, 00, 88, 04, db, 87, 8f, 00)
-	USB_IN ( 0b, ee, e0, 01, 01, 32, 06, 88, 04, db, 87, 8f, 00)
+/**
+ * Tune to a given frequency.
+ * @param handle device handle
+ * @param freq frequency to tune to, in MHz
+ * @return 0 on success or a negative value on error
+ */
+int 
+ib200_set_frequency(struct ib200_handle *handle, int frequency)
+{
+	int number = ib200_channel_of_mhz(frequency);
 
-	ib200_set_LED(devh, true);
+	if (number < 0) {
+		debug_printf("Warning: there are no known broadcasters on frequency %d.", frequency);
+		return -EINVAL;
+	}
+	return ib200_set_channel(handle, number);
+}
 
-	USB_OUT( 0b, ee, e0, 01, 01, 32, 00, 88, 04, db, 87, 8f, 00)
-	USB_IN ( 0b, ee, e0, 01, 01, 32, 07, 88, 04, db, 87, 8f, 00)
+/**
+ * Tune from park to channel with a given PLL setting, searching the VCO from
+ * the power-up default, and check that the lock holds for a while.
+ * @param park channel to tune from, with the default PLL setting
+ * @param lock_time output: from writing the registers of channel to lock, in usecs
+ * @param stable output: whether the PLL locked and stayed locked
+ * @return 0 on success, -ETIMEDOUT if the PLL did not lock on park, or
+ * another negative value on error.
+ */
+static int
+ib200_calibration_run(struct ib200_handle *handle, const struct ib200_channel *park,
+	const struct ib200_channel *channel, const struct ib200_pll_setting *setting,
+	uint64_t *lock_time, bool *stable)
+{
+	struct max2163_status status;
+	uint64_t start;
+	int i, ret;
 
-	ib200_set_LED(devh, true);
+	*stable = false;
 
-	USB_OUT( 0b, ee, e0, 01, 01, 32, 00, 88, 04, db, 87, 8f, 00)
-	USB_IN ( 0b, ee, e0, 01, 01, 32, 07, 88, 04, db, 87, 8f, 00)
+	/* Every run searches from the same place */
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	max2163_set_channel(handle, park);
+	max2163_set_pll(handle, NULL);
+	max2163_set_vco(handle, NULL);
+	ret = max2163_commit(handle);
+	ib200_unlock(handle);
+	if (ret == 0)
+		ret = ib200_wait_for_lock(handle, ib200_now(), IB200_LOCK_TIMEOUT, lock_time, &status);
+	if (ret < 0)
+		return ret;
 
-	ib200_set_LED(devh, true);
+	start = ib200_now();
+	ib200_lock(handle, IB200_PRIO_TUNE);
+	max2163_set_channel(handle, channel);
+	max2163_set_pll(handle, setting);
+	max2163_set_vco(handle, NULL);
+	ret = max2163_commit(handle);
+	ib200_unlock(handle);
+	if (ret < 0)
+		return ret;
 
-	USB_OUT( 0b, ee, e0, 01, 01, 32, 00, 88, 04, db, 87, 8f, 00)
-	USB_IN ( 0b, ee, e0, 01, 01, 32, 08, 88, 04, db, 87, 8f, 00)
+	ret = ib200_wait_for_lock(handle, start, IB200_LOCK_TIMEOUT, lock_time, &status);
+	if (ret == -ETIMEDOUT)
+		return 0;
+	if (ret < 0)
+		return ret;
 
-	ib200_set_LED(devh, true);
+	for (i=0; i<IB200_CALIBRATION_SAMPLES; ++i) {
+		usleep(IB200_CALIBRATION_INTERVAL);
+		ib200_status_invalidate(handle);
+		ret = ib200_get_status(handle, &status);
+		if (ret < 0)
+			return ret;
+		if (! max2163_locked(&status))
+			return 0;
+	}
+	*stable = true;
+	return 0;
+}
 
-	USB_OUT( 0b, ee, e0, 01, 01, 32, 00, 88, 04, db, 87, 8f, 00)
-	USB_IN ( 0b, ee, e0, 01, 01, 32, 0a, 88, 04, db, 87, 8f, 00)
+/**
+ * Calibrate the PLL of each UHF band with a channel in use: tune to its first
+ * channel with every charge pump current (and CPS_AUTOMATIC) and every VAS
+ * wait time, and keep the combination that locks fastest on average without
+ * ever losing the lock. Tunes start from the channel in use furthest away,
+ * and a band is skipped when that one does not lock. The results go to the
+ * profile of the handle, which the tune path applies.
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_calibrate(struct ib200_handle *handle)
+{
+	static const char *charge_pumps[] = { "1.5mA", "2mA", "2.5mA", "3mA", "auto" };
+	static const int wait_times[] = { 14336, 24576, 34816, 45056 };
+	const struct ib200_channel *bands[IB200_BAND_COUNT] = { NULL };
+	const struct ib200_channel *first = NULL, *last = NULL, *channel, *park;
+	struct ib200_pll_setting setting, best;
+	uint64_t lock_time, total;
+	int number, band, charge_pump, wait_time, run, ret;
+	bool stable;
+
+	for (number=IB200_CHANNEL_MIN; number<=IB200_CHANNEL_MAX; ++number) {
+		channel = handle->channels ? ib200_channel_get(handle->channels, number) : NULL;
+		if (! channel)
+			continue;
+		if (! first)
+			first = channel;
+		last = channel;
+		band = ib200_channel_band(channel);
+		if (! bands[band])
+			bands[band] = channel;
+	}
+	if (first == last) {
+		debug_printf("Calibration takes two channels in use at least");
+		return -EINVAL;
+	}
 
-	USB_OUT( 0b, 00, 20, 82, 01, 15, 80, 00, 32, a7, 4a, 0b, 04)
-	USB_IN ( 0b, 00, 20, 82, 01, 15, 80, 03, 32, a7, 4a, 0b, 04)
+	for (band=0; band<IB200_BAND_COUNT; ++band) {
+		channel = bands[band];
+		if (! channel)
+			continue;
+		park = channel->frequency - first->frequency > last->frequency - channel->frequency ? first : last;
+		printf("UHF band %d, channel %d (from channel %d):\n", band, channel->number, park->number);
+
+		best.valid = false;
+		ret = 0;
+		for (charge_pump=0; charge_pump<=4 && ret != -ETIMEDOUT; ++charge_pump)
+			for (wait_time=0; wait_time<4; ++wait_time) {
+				memset(&setting, 0, sizeof(setting));
+				setting.valid = true;
+				setting.cps_automatic = charge_pump == 4;
+				setting.charge_pump = setting.cps_automatic ? 0 : charge_pump;
+				setting.wait_time = wait_time;
+
+				total = 0;
+				stable = true;
+				for (run=0; run<IB200_CALIBRATION_RUNS && stable; ++run) {
+					ret = ib200_calibration_run(handle, park, channel, &setting, &lock_time, &stable);
+					if (ret == -ETIMEDOUT)
+						break;
+					if (ret < 0) {
+						debug_printf("Calibration of UHF band %d failed", band);
+						return ret;
+					}
+					total += lock_time;
+				}
+				if (ret == -ETIMEDOUT)
+					break;
+
+				printf("  charge pump %-5s, VAS wait %5d: ", charge_pumps[charge_pump], wait_times[wait_time]);
+				if (! stable) {
+					printf("unstable\n");
+					continue;
+				}
+				setting.lock_time = total / IB200_CALIBRATION_RUNS;
+				printf("%u usecs\n", setting.lock_time);
+				if (! best.valid || setting.lock_time < best.lock_time)
+					best = setting;
+			}
 
-	USB_OUT( 0b, 00, 00, 82, 01, 15, 80, c3, 32, a7, 4a, 0b, 04)
+		if (ret == -ETIMEDOUT) {
+			printf("  channel %d did not lock, skipping the band\n", park->number);
+			continue;
+		}
+		if (! best.valid) {
+			printf("  no stable setting, keeping the default\n");
+			continue;
+		}
+		printf("  using charge pump %s, VAS wait %d\n",
+			charge_pumps[best.cps_automatic ? 4 : best.charge_pump], wait_times[best.wait_time]);
+		ib200_profile_set_pll(&handle->profile, band, &best);
+	}
 	return 0;
 }
 
 /**
- * Tune to a given frequency.
- * @param devh USB device handle
- * @param freq frequency to tune to
- * @return 0 on success or a negative value on error
+ * Read a MAX2163 register: select it with a write, then read the I2C response.
+ * Called with the control pipe held.
+ * @return 0 on success or a negative value on error.
  */
-int 
-ib200_set_frequency(struct ib200_handle *handle, int frequency)
+static int
+max2163_read(struct ib200_handle *handle, unsigned char reg, unsigned char *value)
 {
 	uint16_t addr = (MAX2163_I2C_WRITE_ADDR << 8) | MAX2163_I2C_WRITE_ADDR;
-	libusb_device_handle *devh = handle->devh;
-	int i, ret, freq_range, n_divider;
-	int valid_frequencies[] = {
-		473, 479, 485, 491, 497, 503, 509, 515, 521, 527, 
-		533, 539, 545, 551, 557, 563, 569, 575, 581, 587, 
-		593, 599, 605, 611, 617, 623, 629, 635, 641, 647, 
-		653, 659, 665, 671, 677, 683, 689, 695, 701, 707,
-		713, 719, 725, 731, 737, 743, 749, 755, 761, 767, 
-		773, 779, 785, 791, 797, 803
-	};
-	bool is_valid_frequency = false;
-
-	for (i=0; i<sizeof(valid_frequencies)/sizeof(int); ++i)
-		if (valid_frequencies[i] == frequency) {
-			is_valid_frequency = true;
-			break;
-		}
-
-	if (! is_valid_frequency) {
-		debug_printf("Warning: there are no known broadcasters on frequency %d.", frequency);
-		return -EINVAL;
-	}
+	unsigned char buf[32];
+	int ret;
 
-	if (frequency < 488)
-		freq_range = UHF_RANGE_470_488MHZ;
-	else if (frequency < 512)
-		freq_range = UHF_RANGE_488_512MHZ;
-	else if (frequency < 542)
-		freq_range = UHF_RANGE_512_542MHZ;
-	else if (frequency < 572)
-		freq_range = UHF_RANGE_542_572MHZ;
-	else if (frequency < 608)
-		freq_range = UHF_RANGE_572_608MHZ;
-	else if (frequency < 656)
-		freq_range = UHF_RANGE_608_656MHZ;
-	else if (frequency < 710)
-		freq_range = UHF_RANGE_656_710MHZ;
-	else
-		freq_range = UHF_RANGE_710_806MHZ;
+	ret = ib200_i2c_write(handle, addr, reg, 0, 0, /* reg offset: */ 0x00);
+	if (ret < 0)
+		return ret;
 
-	/* Initialize the RF Filter Register at 0x03 */
-	ret = ib200_i2c_write(devh, addr, RF_FILTER_REG, 
-			 freq_range | UHF_RANGE_488_512MHZ | AGC_MINUS_66DBM | PWRDET_BUF_ON_GC1,
-             0x6e, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, RF_FILTER_REG, 0x6e);
-	if (ret < 0) {
-		debug_printf("Failed to configure the RF Filter Register");
+/* QUESTION: i2c read function really does not specify from which I2C address
+             and from which register it will read?! */
+	ret = ib200_i2c_read(handle, buf, sizeof(buf));
+	if (ret < 0)
 		return ret;
+	if (ret <= IB200_I2C_READ_VALUE) {
+		debug_printf("short I2C read response (%d bytes)", ret);
+		return -EIO;
 	}
-	
-	/* Initialize the N-Divider Registers */
-	n_divider = ((64 + frequency * DEFAULT_RDIVIDER) / VCO_CRYSTAL_FREQ) + 1;
+	*value = buf[IB200_I2C_READ_VALUE];
+	return 0;
+}
 
-	printf("\nFreq: %d\nN-DIV: %#x\nR-DIV: %#x\n\n", frequency, n_divider, DEFAULT_RDIVIDER);
+/**
+ * Get the MAX2163 status registers, decoded. STATUS_REG and VAS_STATUS_REG are
+ * read at most once per status.ttl; callers in between get the cached sample,
+ * and callers that miss at the same time share a single read.
+ * @param status output
+ * @return 0 on success or a negative value on error.
+ */
+int
+ib200_get_status(struct ib200_handle *handle, struct max2163_status *status)
+{
+	struct ib200_status_cache *cache = &handle->status;
+	struct max2163_status sample;
+	int ret;
 
-	ret = ib200_i2c_write(devh, addr, NDIVIDER_MSB_REG, 
- 			 PLL_MOST_NDIVIDER(n_divider), 0xd5, /* reg offset: */ 0x00);
-	if (ret == 0)
-		ret = ib200_shadow_write(devh, RF_FILTER_REG, 0xd5);
-	if (ret < 0) {
-		debug_printf("Failed to configure the N-Divider MSB Register");
-		return ret;
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->valid && ib200_now() - cache->status.sampled < cache->ttl) {
+		*status = cache->status;
+		cache->hits++;
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
 	}
-	
-	/* Initialize the N-Divider LSB/LIN Register */
-	ret = ib200_i2c_write(devh, addr, NDIVIDER_LSB_REG, 
-                          STBY_NORMAL | RFVGA_NORMAL | MIX_NORMAL |
-                          PLL_LEAST_NDIVIDER(n_divider),
-                          0x11, /* reg offset: */ 0x00);
+	pthread_mutex_unlock(&cache->mutex);
+
+	ib200_lock(handle, IB200_PRIO_POLL);
+
+	/* Somebody else may have refreshed the sample while we waited for the pipe */
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->valid && ib200_now() - cache->status.sampled < cache->ttl) {
+		*status = cache->status;
+		cache->hits++;
+		pthread_mutex_unlock(&cache->mutex);
+		ib200_unlock(handle);
+		return 0;
+	}
+	cache->misses++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	memset(&sample, 0, sizeof(sample));
+	ret = max2163_read(handle, STATUS_REG, &sample.status);
 	if (ret == 0)
-		ret = ib200_shadow_write(devh, NDIVIDER_LSB_REG, 0x11);
+		ret = max2163_read(handle, VAS_STATUS_REG, &sample.vas_status);
+	ib200_unlock(handle);
 	if (ret < 0) {
-		debug_printf("Failed to configure the N-Divider LSB/LIN Register");
+		debug_printf("Failed to read the MAX2163 status registers");
 		return ret;
 	}
 
+	sample.sampled = ib200_now();
+	sample.pwr_cycle = sample.status & PWR_CYCLE;
+	sample.charge_pump = (sample.status & CHARGE_PUMP_SETTING) >> 1;
+	sample.vtune_adc = (sample.status & VTUNE_ADC_CONVERSION) >> 3;
+	sample.vase = sample.vas_status & VASE;
+	sample.vasa = sample.vas_status & VASA;
+	sample.vco_subband = (sample.vas_status & VCO_SUBBAND) >> 2;
+	sample.vco_autoselect = (sample.vas_status & VCO_AUTOSELECT) >> 6;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->status = sample;
+	cache->valid = true;
+	pthread_mutex_unlock(&cache->mutex);
+
+	*status = sample;
 	return 0;
 }
 
 bool
 ib200_has_signal(struct ib200_handle *handle)
 {
-	uint16_t addr = (MAX2163_I2C_WRITE_ADDR << 8) | MAX2163_I2C_WRITE_ADDR;
-	libusb_device_handle *devh = handle->devh;
-	unsigned char buf[32];
-	int ret;
+	struct max2163_status status;
 
-	ret = ib200_i2c_write(devh, addr, STATUS_REG, 0, 0, /* reg offset: */ 0x00);
-	debug_printf("ib200_i2c_write=%d", ret);
+	if (ib200_get_status(handle, &status) < 0)
+		return false;
 
-/* QUESTION: i2c read function really does not specify from which I2C address
-             and from which register it will read?! */
-	ret = ib200_i2c_read(devh, buf, sizeof(buf));
-	debug_printf("ib200_i2c_read=%d", ret);
-	if (ret > 0)
-		hexdump(buf, ret);
+	debug_printf("STATUS=%#04x VAS_STATUS=%#04x: VTUNE ADC %d, charge pump %d, VCO %d sub-band %d%s%s",
+		status.status, status.vas_status, status.vtune_adc, status.charge_pump,
+		status.vco_autoselect, status.vco_subband,
+		status.vasa ? ", VAS active" : "", status.pwr_cycle ? ", power cycled" : "");
 
-	return true;
+	/* The tuning voltage ADC reads 0 or 7 when the VCO is at a rail, out of lock */
+	return status.vtune_adc != 0 && status.vtune_adc != 7;
 }
 
 static void 
 iso_callback(struct libusb_transfer *transfer)
 {
-	int i;
-	struct ib200_handle *handle = (struct ib200_handle *) transfer->user_data;
+	int i, length = 0;
+	uint64_t now;
+	struct ib200_iso *iso = (struct ib200_iso *) transfer->user_data;
+	struct ib200_handle *handle = iso->handle;
 	struct user_options *user_options = handle->user_options;
 	handle->pending_requests--;
 
 	debug_printf("iso_callback called. transfer_status=%d\n", transfer->status);
+	ib200_mark_failed(handle, ib200_transfer_status(transfer->status));
 
 	for (i=0; i<transfer->num_iso_packets; ++i) {
 		struct libusb_iso_packet_descriptor *desc =  &transfer->iso_packet_desc[i];
@@ -1173,8 +3531,22 @@ iso_callback(struct libusb_transfer *transfer)
 			if (handle->fp)
 				fwrite(pbuf, desc->actual_length, sizeof(char), handle->fp);
 		}
+		length += desc->actual_length;
 	}
 
+	now = ib200_now();
+	if (! handle->startup.first_packet && length > 0) {
+		handle->startup.first_packet = true;
+		handle->startup.phase[IB200_PHASE_FIRST_PACKET] = now - handle->startup.mark;
+		handle->startup.total = now - handle->startup.start;
+	}
+	ib200_trace_record(&handle->trace, IB200_TRACE_ISO, LIBUSB_ENDPOINT_IN, 0,
+		transfer->num_iso_packets ? libusb_get_iso_packet_buffer_simple(transfer, 0) : NULL,
+		length, ib200_transfer_status(transfer->status), iso->submitted, now);
+	IB200_PROBE5(iso__complete, transfer, transfer->status, length,
+		transfer->num_iso_packets, now - iso->submitted);
+
+	free(iso);
 	libusb_free_transfer(transfer);
 }
 
@@ -1182,11 +3554,22 @@ ssize_t
 ib200_read(struct ib200_handle *handle, void *buf, size_t num_packets, size_t packet_size)
 {
 	struct libusb_transfer *transfer;
+	struct ib200_iso *iso;
 	int ret, max_packet_size;
 
+	iso = malloc(sizeof(*iso));
+	if (! iso) {
+		perror("malloc");
+		return -ENOMEM;
+	}
+	iso->handle = handle;
+	if (! handle->startup.mark)
+		handle->startup.mark = ib200_now();
+
 	transfer = libusb_alloc_transfer(num_packets);
 	if (! transfer) {
 		perror("libusb_alloc_transfer");
+		free(iso);
 		return -ENOMEM;
 	}
 
@@ -1196,21 +3579,28 @@ ib200_read(struct ib200_handle *handle, void *buf, size_t num_packets, size_t pa
 		printf("Limiting packet size to max length=%d\n", (int) packet_size);
 	}
 
-	libusb_fill_iso_transfer(transfer, handle->devh, IB200_CONFIG_ENDPOINT, buf, packet_size, num_packets, iso_callback, handle, 10000);
+	libusb_fill_iso_transfer(transfer, handle->devh, IB200_CONFIG_ENDPOINT, buf, packet_size, num_packets, iso_callback, iso, 10000);
 	libusb_set_iso_packet_lengths(transfer, packet_size);
 	
+	iso->submitted = ib200_now();
 	ret = libusb_submit_transfer(transfer);
+	IB200_PROBE4(iso__submit, transfer, num_packets, packet_size, ret);
 	if (ret) {
-		debug_printf("Error submitting transfer: %s", ib200_error(errno));
-		return 1;
+		debug_printf("Error submitting transfer: %s", libusb_error_name(ret));
+		libusb_free_transfer(transfer);
+		free(iso);
+		handle->pending_requests--;
+		ib200_mark_failed(handle, ret);
+		return ret;
 	}
 
 //	These URBs where not seen at logs/Log/lucasvr-02-tune_to_record.log:
 
 // I don't know why these 2 URBs trigger responses from ISOC requests:
-	usb_out(handle->devh, 0x0b, 0x00, 0x00, 0x82, 0x01, 0x16, 0x00, 0x00, 0xa8, 0x6d, 0x0d, 0x89, 0x43);
-	usleep(16000); //do we need to delay 16ms here?
-	usb_out(handle->devh, 0x0b, 0x00, 0x20, 0x82, 0x01, 0x15, 0x80, 0x00, 0x1c, 0x0b, 0x00, 0x00, 0x74);
+	ib200_lock(handle, IB200_PRIO_STREAM);
+	usb_out(handle, 0x0b, 0x00, 0x00, 0x82, 0x01, 0x16, 0x00, 0x00, 0xa8, 0x6d, 0x0d, 0x89, 0x43);
+	usb_out(handle, 0x0b, 0x00, 0x20, 0x82, 0x01, 0x15, 0x80, 0x00, 0x1c, 0x0b, 0x00, 0x00, 0x74);
+	ib200_unlock(handle);
 
 	return 0;
 }
@@ -1223,11 +3613,42 @@ show_usage(char *appname)
 		   "  -b, --blink               Blink LED!\n"
 		   "  -h, --help                This help\n"
 		   "  -i, --init                Initialize tuner\n"
-		   "  -f, --frequency <freq>    Tune to frequency <freq>\n"
+		   "      --burst               Write consecutive MAX2163 registers with a single command\n"
+		   "                            (experimental: the command layout is not in any capture)\n"
+		   "  -c, --channel <n>         Tune to UHF channel <n>\n"
+		   "  -f, --frequency <freq>    Tune to frequency <freq>, in MHz (473, 479, ...)\n"
 		   "  -q, --quiet               Do not output debugging messages\n"
 		   "  -s, --check-signal        Check signal\n"
 		   "  -t, --test=<test_number>	Run one of the available development tests\n"
 		   "  -w, --writeto=<file>      Write transport stream packets to <file>\n"
+		   "      --trace=<file>        Save a trace of the USB transfers to <file> on exit and on SIGUSR1\n"
+		   "      --trace-format=<fmt>  Trace format: text (UsbSnoop-like, default) or chrome\n"
+		   "      --sequence=<file>     Run the vendor command sequence in <file>\n"
+		   "      --timing=<mode>       Sequence timing: original (recorded delays, default)\n"
+		   "                            or fast (settle times from delays.h only)\n"
+		   "      --status-ttl=<msecs>  Reuse MAX2163 status reads for <msecs> (default 100)\n"
+		   "      --firmware-window=<n> Firmware chunks in flight during the upload (1-16, default 16)\n"
+		   "      --firmware=<file>     Upload the firmware in <file>, as extracted by firmware-cutter.py\n"
+		   "      --firmware-marker     Keep the checksum of the firmware uploaded in SMI-2020CBE registers\n"
+		   "                            0xfc-0xff, which no capture touches, and skip uploading it again\n"
+		   "      --force-firmware      Upload the firmware even if the marker shows the device runs it\n"
+		   "      --cold-init           Run the whole init sequence even if --firmware-marker shows the\n"
+		   "                            device is already initialized\n"
+		   "      --startup-report=<file> Write the time spent in each startup phase to <file> (JSON),\n"
+		   "                            stopping once the first isochronous packet arrived\n"
+		   "      --all-devices         Open every device and initialize them concurrently; the other\n"
+		   "                            options apply to the first one\n"
+		   "      --channels=<file>     Read the channels in use from <file> (default: " IB200_CHANNELS_FILE "\n"
+		   "                            if present, else every UHF channel from 14 to 69)\n"
+		   "      --wait-lock           Return from tuning once the PLL locked, and print how long it took\n"
+		   "      --wait-sync           Then wait for 0b ee e0 01 register 0x32 to reach 0x0a, which\n"
+		   "                            seems to follow the demodulator sync, and print how long it took\n"
+		   "      --profile=<file>      Keep what was learned about the tuner in <file>: with --wait-lock,\n"
+		   "                            channels tuned before skip the VCO search. The file is not tied\n"
+		   "                            to a device: use one per device\n"
+		   "      --calibrate           Find the fastest stable charge pump current and VAS wait time of\n"
+		   "                            each UHF band and store them in the profile (implies --wait-lock)\n"
+		   "\nSend SIGUSR2 to print the control transfer latencies of each address space.\n"
 		   , appname);
 
 }
@@ -1236,16 +3657,40 @@ struct user_options *
 parse_args(int argc, char **argv)
 {
 	struct user_options *opts, zeroed_opts;
-	const char *short_options = "bif:qsw:t:h";
+	const char *short_options = "bic:f:qsw:t:h";
+	enum { OPT_BURST = 256, OPT_TRACE, OPT_TRACE_FORMAT, OPT_SEQUENCE, OPT_TIMING, OPT_STATUS_TTL,
+		OPT_FIRMWARE_WINDOW, OPT_FIRMWARE, OPT_FORCE_FIRMWARE, OPT_FIRMWARE_MARKER,
+		OPT_COLD_INIT, OPT_STARTUP_REPORT, OPT_ALL_DEVICES, OPT_CHANNELS,
+		OPT_WAIT_LOCK, OPT_WAIT_SYNC, OPT_PROFILE, OPT_CALIBRATE };
 	struct option long_options[] = {
 		{ "blink", 0, 0, 0 },
 		{ "check-signal", 0, 0, 0 },
+		{ "channel", 1, 0, 'c' },
 		{ "frequency", 1, 0, 'f' },
 		{ "help", 0, 0, 0 },
 		{ "init", 0, 0, 0 },
 		{ "quiet", 0, 0, 'q' },
 		{ "test", 1, 0, 't' },
 		{ "writeto", 0, 0, 'w' },
+		{ "burst", 0, 0, OPT_BURST },
+		{ "trace", 1, 0, OPT_TRACE },
+		{ "trace-format", 1, 0, OPT_TRACE_FORMAT },
+		{ "sequence", 1, 0, OPT_SEQUENCE },
+		{ "timing", 1, 0, OPT_TIMING },
+		{ "status-ttl", 1, 0, OPT_STATUS_TTL },
+		{ "firmware-window", 1, 0, OPT_FIRMWARE_WINDOW },
+		{ "firmware", 1, 0, OPT_FIRMWARE },
+		{ "firmware-marker", 0, 0, OPT_FIRMWARE_MARKER },
+		{ "force-firmware", 0, 0, OPT_FORCE_FIRMWARE },
+		{ "cold-init", 0, 0, OPT_COLD_INIT },
+		{ "startup-report", 1, 0, OPT_STARTUP_REPORT },
+		{ "all-devices", 0, 0, OPT_ALL_DEVICES },
+		{ "channels", 1, 0, OPT_CHANNELS },
+		{ "wait-lock", 0, 0, OPT_WAIT_LOCK },
+		{ "wait-sync", 0, 0, OPT_WAIT_SYNC },
+		{ "profile", 1, 0, OPT_PROFILE },
+		{ "calibrate", 0, 0, OPT_CALIBRATE },
+		{ 0, 0, 0, 0 }
 	};
 
 	opts = calloc(1, sizeof(struct user_options));
@@ -1265,6 +3710,9 @@ parse_args(int argc, char **argv)
 			case 'b':
 				opts->blink = true;
 				break;
+			case 'c':
+				opts->channel = atoi(optarg);
+				break;
 			case 'f':
 				opts->frequency = atoi(optarg);
 				break;
@@ -1286,6 +3734,86 @@ parse_args(int argc, char **argv)
 			case 'w':
 				opts->writeto = strdup(optarg);
 				break;
+			case OPT_BURST:
+				opts->burst = true;
+				break;
+			case OPT_TRACE:
+				opts->trace = strdup(optarg);
+				break;
+			case OPT_TRACE_FORMAT:
+				if (! strcmp(optarg, "chrome"))
+					opts->trace_format = IB200_TRACE_CHROME;
+				else if (! strcmp(optarg, "text"))
+					opts->trace_format = IB200_TRACE_TEXT;
+				else {
+					fprintf(stderr, "Invalid trace format '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_SEQUENCE:
+				opts->sequence = strdup(optarg);
+				break;
+			case OPT_TIMING:
+				if (! strcmp(optarg, "fast"))
+					opts->fast_sequence = true;
+				else if (! strcmp(optarg, "original"))
+					opts->fast_sequence = false;
+				else {
+					fprintf(stderr, "Invalid timing mode '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_STATUS_TTL:
+				opts->status_ttl = atoi(optarg);
+				opts->status_ttl_set = true;
+				if (opts->status_ttl < 0) {
+					fprintf(stderr, "Invalid status TTL '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_FIRMWARE_WINDOW:
+				opts->firmware_window = atoi(optarg);
+				if (opts->firmware_window < 1 || opts->firmware_window > IB200_CMD_MAX_WINDOW) {
+					fprintf(stderr, "Invalid firmware window '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_FIRMWARE:
+				opts->firmware = strdup(optarg);
+				break;
+			case OPT_FORCE_FIRMWARE:
+				opts->force_firmware = true;
+				break;
+			case OPT_FIRMWARE_MARKER:
+				opts->firmware_marker = true;
+				break;
+			case OPT_COLD_INIT:
+				opts->cold_init = true;
+				opts->initialize = true;
+				break;
+			case OPT_STARTUP_REPORT:
+				opts->startup_report = strdup(optarg);
+				break;
+			case OPT_ALL_DEVICES:
+				opts->all_devices = true;
+				break;
+			case OPT_CHANNELS:
+				opts->channels = strdup(optarg);
+				break;
+			case OPT_WAIT_LOCK:
+				opts->wait_lock = true;
+				break;
+			case OPT_WAIT_SYNC:
+				opts->wait_sync = true;
+				break;
+			case OPT_PROFILE:
+				opts->profile = strdup(optarg);
+				break;
+			case OPT_CALIBRATE:
+				/* The settle times of the register writes would be part of the lock times */
+				opts->calibrate = true;
+				opts->wait_lock = true;
+				break;
 			case '?':
 			default:
 				exit(1);
@@ -1309,11 +3837,41 @@ main(int argc, char **argv)
 	bool has_signal;
 	libusb_context *ctx;
 	libusb_device **dev_list;
-	struct ib200_handle *handle;
+	struct ib200_handle *handle, *handles[IB200_MAX_DEVICES];
 	struct user_options *user_options;
+	struct ib200_firmware firmware;
+	struct ib200_channels channels;
+	uint64_t start;
+	int i, num_handles, channel, rets[IB200_MAX_DEVICES];
+	bool tuned = false;
 
+	memset(&firmware, 0, sizeof(firmware));
 	user_options = parse_args(argc, argv);
 
+	if (user_options->channels)
+		ret = ib200_channels_load(user_options->channels, &channels);
+	else if (access(IB200_CHANNELS_FILE, R_OK) == 0)
+		ret = ib200_channels_load(IB200_CHANNELS_FILE, &channels);
+	else {
+		ib200_channels_default(&channels);
+		ret = 0;
+	}
+	if (ret < 0) {
+		free(user_options);
+		return 1;
+	}
+
+	channel = user_options->channel;
+	if (! channel && user_options->frequency) {
+		channel = ib200_channel_of_mhz(user_options->frequency);
+		if (channel < 0) {
+			fprintf(stderr, "There are no known broadcasters on frequency %d.\n", user_options->frequency);
+			free(user_options);
+			return 1;
+		}
+	}
+
+	start = ib200_now();
 	ret = libusb_init(&ctx);
 	if (ret) {
 		debug_printf("libusb_init: failed with error %d", ret);
@@ -1328,10 +3886,42 @@ main(int argc, char **argv)
 		goto out_exit;
 	}
 
-	handle = ib200_open_device(dev_list, n);
-	if (! handle)
+	if (user_options->all_devices)
+		num_handles = ib200_open_devices(ctx, dev_list, n, handles, IB200_MAX_DEVICES);
+	else {
+		handles[0] = ib200_open_device(ctx, dev_list, n);
+		num_handles = handles[0] ? 1 : 0;
+	}
+	if (num_handles == 0)
 		goto out_free;
-	handle->user_options = (void *) user_options;
+	handle = handles[0];
+	signal(SIGUSR1, ib200_signal);
+	signal(SIGUSR2, ib200_signal);
+
+	if (user_options->firmware) {
+		ret = ib200_firmware_load(user_options->firmware, &firmware);
+		if (ret < 0)
+			goto out_close;
+	}
+
+	for (i=0; i<num_handles; ++i) {
+		handles[i]->startup.start = start;
+		ib200_phase_done(handles[i], IB200_PHASE_OPEN, start);
+		handles[i]->user_options = (void *) user_options;
+		if (user_options->burst)
+			handles[i]->i2c_burst = IB200_BURST_UNKNOWN;
+		if (user_options->status_ttl_set)
+			handles[i]->status.ttl = (uint64_t) user_options->status_ttl * 1000;
+		if (user_options->firmware)
+			handles[i]->firmware = &firmware;
+		handles[i]->channels = &channels;
+	}
+
+	if (user_options->profile) {
+		ret = ib200_profile_load(user_options->profile, &handle->profile);
+		if (ret < 0)
+			goto out_close;
+	}
 
 	if (user_options->blink) {
 		ret = ib200_blink_LED(handle);
@@ -1339,8 +3929,18 @@ main(int argc, char **argv)
 			goto out_close;
 	}
 
-	if (user_options->initialize) {
-		ret = ib200_init(handle);
+	if (user_options->initialize && num_handles > 1) {
+		/* Each device is tuned as well. The rest only drives the first one, which the profile belongs to */
+		ib200_init_parallel(handles, num_handles, channel, rets);
+		if (rets[0] != 0) {
+			debug_printf("The first device failed to initialize");
+			ret = rets[0];
+			goto out_close;
+		}
+		tuned = channel != 0;
+	} else if (user_options->initialize) {
+		/* The MAX2163 comes up tuned, so that ib200_set_channel() below has nothing left to write */
+		ret = ib200_init(handle, channel);
 		if (ret < 0)
 			goto out_close;
 	}
@@ -1354,17 +3954,18 @@ main(int argc, char **argv)
 		switch(user_options->run_test) {
 			case 1:
 				printf("Testing misterious registers:\n\n");
-				test_misterious_registers(handle->devh);
+				test_misterious_registers(handle);
 				break;
 			case 2:
 				printf("Testing misterious registers 2 (0b ee e0 01):\n\n");
-				test_misterious_registers_2(handle->devh);
+				test_misterious_registers_2(handle);
 				break;
 			case 3:
 				printf("Replaying logs to tune to Record:\n\n");
 				if (!user_options->writeto)
 					printf("You should try it with --writeto=filename!\n");
 				ret = tune_to_record(handle);
+				tuned = false;
 				if (ret < 0)
 					goto out_close;
 				break;
@@ -1373,8 +3974,37 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (user_options->frequency) {
-		ret = ib200_set_frequency(handle, user_options->frequency);
+	if (user_options->calibrate) {
+		ret = ib200_calibrate(handle);
+		tuned = false;
+		if (ret < 0)
+			goto out_close;
+	}
+
+	if (channel && ! tuned) {
+		ret = ib200_set_channel(handle, channel);
+		if (ret < 0 && ib200_needs_recovery(handle) && ib200_recover(handle) == 0)
+			ret = ib200_set_channel(handle, channel);
+		if (ret < 0)
+			goto out_close;
+	}
+
+	if (user_options->sequence) {
+		struct ib200_seq_op *ops;
+		int count = ib200_seq_load(user_options->sequence, &ops);
+
+		if (count < 0) {
+			ret = count;
+			goto out_close;
+		}
+		if (user_options->fast_sequence) {
+			/* Drop the recorded gaps, keeping only the settle times known to be needed */
+			int i;
+			for (i=0; i<count; ++i)
+				ops[i].delay = IB200_SEQ_DELAY_AUTO;
+		}
+		ret = ib200_seq_execute(handle, ops, count);
+		free(ops);
 		if (ret < 0)
 			goto out_close;
 	}
@@ -1397,22 +4027,54 @@ main(int argc, char **argv)
 
 		handle->pending_requests = 0;
 		while (true) {
+			ib200_poll_signals(handle);
+			if (user_options->startup_report && handle->startup.first_packet)
+				break;
+			if (ib200_needs_recovery(handle)) {
+				ret = ib200_recover(handle);
+				if (ret < 0)
+					break;
+			}
 			if (handle->pending_requests<8) {
 				handle->pending_requests++;
 
 				ret = ib200_read(handle, buf, num_packets, packet_size);
 				if (! user_options->quiet)
 					printf("Sent a request for an isochronous transfer [pending=%d]\n", handle->pending_requests);
-			    if (ret < 0)
+			    if (ret < 0 && ! ib200_needs_recovery(handle))
 				    break;
+			} else {
+				/* Reap completed transfers, so that failures are noticed */
+				ret = ib200_cmd_handle_events(handle, NULL);
+				if (ret < 0)
+					break;
 			}
 		}
+		/* The transfers in flight write to buf and handle->fp */
+		while (handle->pending_requests > 0 && ! ib200_needs_recovery(handle))
+			if (ib200_cmd_handle_events(handle, NULL) < 0)
+				break;
 		fclose(handle->fp);
 		free(buf);
 	}
 
+	if (user_options->startup_report) {
+		FILE *fp = fopen(user_options->startup_report, "w");
+
+		if (! fp) {
+			perror(user_options->startup_report);
+			goto out_close;
+		}
+		ret = ib200_startup_report(handle, fp);
+		fclose(fp);
+	}
+
 out_close:
-	ib200_close_device(handle);
+	if (user_options->profile)
+		ib200_profile_save(user_options->profile, &handle->profile);
+	for (i=0; i<num_handles; ++i)
+		ib200_close_device(handles[i]);
+	ib200_firmware_release(&firmware);
 out_free:
 	libusb_free_device_list(dev_list, 1);
 out_exit: